@@ -0,0 +1,1152 @@
+/*
+ * Cache the result of reading the makefiles
+ */
+#include "make.h"
+#include <sys/mman.h>
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+// If the PDPMAKE_CACHE macro, from the command line or the environment,
+// names a file, such as .pdpmake.cache, the names, rules and macros
+// which result from reading the makefiles are saved to it.  A later
+// invocation of make loads them from the file instead of reading the
+// makefiles, provided:
+//
+// - the state before the makefiles are read is the same.  This covers
+//   the options, pragmas, current directory, built-in rules and the
+//   macros from the command line, MAKEFLAGS and the environment.
+// - every makefile and include file, including those which were looked
+//   for but didn't exist, is unchanged.
+//
+// The result isn't saved if reading the makefiles ran a shell command,
+// expanded a wildcard, read standard input or involved an include file
+// which could be made.
+//
+// The result of reading each include file is also saved separately: the
+// macros it used or assigned, with their values and levels as they were
+// before the file first referred to them, and the macro assignments and
+// rules it contained.  When the makefiles have to be read, an include file
+// which is unchanged, and whose macros have the same values, is replayed
+// from the cache instead of being read.  Include files which include
+// other files, or whose result couldn't be saved for one of the reasons
+// above, aren't saved.
+//
+// Nothing is saved if the makefiles define the .POSIX special target.
+//
+// The file is in the byte order of the machine which wrote it.  It
+// starts with a header:
+//
+//   magic[8] key[8] checksum[8]
+//
+// The key is a hash of the state before the makefiles are read and the
+// checksum covers the rest of the file.  Then come the include files,
+// the files read and the resulting state, if it could be saved.
+struct cached_file {
+	struct cached_file *f_next;
+	char *f_name;			// Name of makefile
+	bool f_exists;			// File existed
+	dev_t f_dev;			// Device of file
+	ino_t f_ino;			// Inode of file
+	off_t f_size;			// Size of file
+	struct timespec f_tim;	// Modification time of file
+};
+
+struct buffer {
+	char *b_buf;
+	size_t b_len;			// Bytes used
+	size_t b_size;			// Bytes allocated
+};
+
+// The result of reading an include file
+struct fragment {
+	struct fragment *fr_next;	// Next fragment in this bucket
+	char *fr_name;			// Name of include file
+	dev_t fr_dev;			// Device of file
+	ino_t fr_ino;			// Inode of file
+	off_t fr_size;			// Size of file
+	struct timespec fr_tim;	// Modification time of file
+	const char *fr_data;	// Result, in cache file or fr_buf
+	size_t fr_len;			// Length of result
+	struct buffer fr_buf;	// Result recorded by this instance of make
+	bool fr_keep;			// Save fragment in cache file
+};
+
+// An include file being read and recorded
+struct recorder {
+	struct recorder *rc_parent;	// Recorder for including file, if any
+	struct cached_file *rc_file;	// Details of file
+	struct buffer rc_macros;	// Macros used
+	struct buffer rc_ops;	// Macro assignments and rules
+	uint32_t rc_nmacros;	// Number of macros used
+	uint32_t rc_nops;		// Number of assignments and rules
+	char **rc_names;		// Names of macros used or assigned
+	size_t rc_nnames;		// Number of names
+	uint32_t rc_opts;		// Options when file was opened
+	uint64_t rc_suffixes;	// Known suffixes when file was opened
+	bool rc_seen_first;		// First line of makefiles had been seen
+	bool rc_invalid;		// Result can't be saved
+};
+
+#define FNV_OFFSET 14695981039346656037u
+#define FNV_PRIME 1099511628211u
+
+static const char magic[8] = "pdpmkc4";
+static char *cache_file;
+static bool cache_disabled;
+static uint64_t cache_key;
+static struct cached_file *cached_files;
+static struct cached_file **cached_tail = &cached_files;
+static struct cached_file *last_file;
+static struct fragment *fraghead[HTABSIZE];
+static struct recorder *recorder;
+
+// Cache file mapped into memory while the makefiles are read
+static char *cache_map = MAP_FAILED;
+static size_t cache_size;
+
+// Buffer being written and position in data being read
+static struct buffer wbuf;
+static const char *rpos, *rend;
+
+/*
+ * Add bytes to the 64-bit FNV-1a hash 'h'.
+ */
+static uint64_t
+hash(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *s = p;
+
+	while (len--) {
+		h ^= *s++;
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+static uint64_t
+hash_str(uint64_t h, const char *s)
+{
+	return hash(h, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+/*
+ * Calculate the key for the state before the makefiles are read.
+ */
+static uint64_t
+state_key(void)
+{
+	struct name *np;
+	struct rule *rp;
+	struct depend *dp;
+	struct cmd *cp;
+	struct macro *mp;
+	struct file *fp;
+	char *cwd = NULL;
+	size_t len = 0;
+	uint64_t h = hash(FNV_OFFSET, magic, sizeof(magic));
+
+	do {
+		len += 256;
+		cwd = xrealloc(cwd, len);
+		if (getcwd(cwd, len)) {
+			h = hash_str(h, cwd);
+			break;
+		}
+	} while (errno == ERANGE);
+	free(cwd);
+
+	h = hash(h, &opts, sizeof(opts));
+	h = hash(h, &pragma, sizeof(pragma));
+	h = hash(h, &posix_level, sizeof(posix_level));
+	for (fp = makefiles; fp; fp = fp->f_next)
+		h = hash_str(h, fp->f_name);
+
+	for (unsigned int i = 0; i < namesize; i++) {
+		for (np = namehead[i]; np; np = np->n_next) {
+			h = hash_str(h, np->n_name);
+			h = hash(h, &np->n_flag, sizeof(np->n_flag));
+			for (rp = np->n_rule; rp; rp = rp->r_next) {
+				for (dp = rp->r_dep; dp; dp = dp->d_next)
+					h = hash_str(h, dp->d_name->n_name);
+				for (cp = rp->r_cmd; cp; cp = cp->c_next)
+					h = hash_str(h, cp->c_cmd);
+				h = hash_str(h, NULL);
+			}
+		}
+	}
+	for (unsigned int i = 0; i < macrosize; i++) {
+		for (mp = macrohead[i]; mp; mp = mp->m_next) {
+			h = hash_str(h, mp->m_name);
+			h = hash_str(h, mp->m_val);
+			h = hash(h, &mp->m_level, sizeof(mp->m_level));
+			h = hash(h, &mp->m_immediate, sizeof(mp->m_immediate));
+		}
+	}
+	return h;
+}
+
+static void
+put(struct buffer *bp, const void *p, size_t len)
+{
+	if (len == 0)
+		return;
+	if (bp->b_len + len > bp->b_size) {
+		bp->b_size = (bp->b_len + len) * 2;
+		bp->b_buf = xrealloc(bp->b_buf, bp->b_size);
+	}
+	memcpy(bp->b_buf + bp->b_len, p, len);
+	bp->b_len += len;
+}
+
+static void
+put_u32(struct buffer *bp, uint32_t val)
+{
+	put(bp, &val, sizeof(val));
+}
+
+/*
+ * Strings are written as a length and the characters with their
+ * terminating null.  A null pointer is written as an empty string.
+ */
+static void
+put_str(struct buffer *bp, const char *s)
+{
+	uint32_t len = s ? strlen(s) : 0;
+
+	put_u32(bp, len);
+	put(bp, s ? s : "", len + 1);
+}
+
+/*
+ * Return a pointer to the next 'len' bytes of the data being read.
+ */
+static const char *
+skip(size_t len)
+{
+	const char *s = rpos;
+
+	if (len > (size_t)(rend - rpos))
+		error("invalid cache file %s", cache_file);
+	rpos += len;
+	return s;
+}
+
+static void
+get(void *p, size_t len)
+{
+	memcpy(p, skip(len), len);
+}
+
+static uint32_t
+get_u32(void)
+{
+	uint32_t val;
+
+	get(&val, sizeof(val));
+	return val;
+}
+
+/*
+ * Return a string in the file being read.
+ */
+static const char *
+get_str(void)
+{
+	uint32_t len = get_u32();
+	const char *s = rpos;
+
+	if (len >= rend - rpos || s[len] != '\0')
+		error("invalid cache file %s", cache_file);
+	rpos += len + 1;
+	return s;
+}
+
+/*
+ * Note the details of a makefile or include file which is about to be
+ * opened.
+ */
+static struct cached_file *
+note_file(const char *name)
+{
+	struct cached_file *fp;
+	struct stat st;
+
+	if (!cache_file)
+		return NULL;
+
+	fp = xmalloc(sizeof(struct cached_file));
+	memset(fp, 0, sizeof(struct cached_file));
+	fp->f_name = xstrdup(name);
+	if (stat(name, &st) == 0) {
+		fp->f_exists = TRUE;
+		fp->f_dev = st.st_dev;
+		fp->f_ino = st.st_ino;
+		fp->f_size = st.st_size;
+		fp->f_tim = st.st_mtim;
+	}
+	*cached_tail = fp;
+	cached_tail = &fp->f_next;
+	return last_file = fp;
+}
+
+void
+cache_makefile(const char *name)
+{
+	note_file(name);
+}
+
+/*
+ * A makefile changed within the resolution of its timestamp might
+ * change again without it being noticed.
+ */
+static int
+is_racy(struct cached_file *fp)
+{
+	return fp->f_exists && fp->f_tim.tv_sec >= time(NULL) - 1;
+}
+
+/*
+ * Calculate a key for the known suffixes, which determine the types
+ * of targets.
+ */
+static uint64_t
+suffix_key(void)
+{
+	struct name *np = findname(".SUFFIXES");
+	struct rule *rp;
+	struct depend *dp;
+	uint64_t h = FNV_OFFSET;
+
+	for (rp = np ? np->n_rule : NULL; rp; rp = rp->r_next) {
+		for (dp = rp->r_dep; dp; dp = dp->d_next)
+			h = hash_str(h, dp->d_name->n_name);
+	}
+	return h;
+}
+
+/*
+ * Note a macro name in the include file being recorded.  Return TRUE
+ * if it had already been noted.
+ */
+static int
+note_name(const char *name)
+{
+	struct recorder *rc = recorder;
+
+	for (size_t i = 0; i < rc->rc_nnames; i++) {
+		if (strcmp(rc->rc_names[i], name) == 0)
+			return TRUE;
+	}
+	rc->rc_names = xrealloc(rc->rc_names,
+							(rc->rc_nnames + 1) * sizeof(char *));
+	rc->rc_names[rc->rc_nnames++] = xstrdup(name);
+	return FALSE;
+}
+
+/*
+ * Note the value and level of a macro the include file being recorded
+ * depends on.  'mp' is NULL if the macro isn't defined.
+ */
+static void
+note_macro(const char *name, struct macro *mp)
+{
+	struct recorder *rc = recorder;
+	bool exists = mp != NULL;
+
+	put_str(&rc->rc_macros, name);
+	put(&rc->rc_macros, &exists, sizeof(exists));
+	if (mp) {
+		put(&rc->rc_macros, &mp->m_immediate, sizeof(mp->m_immediate));
+		put(&rc->rc_macros, &mp->m_level, sizeof(mp->m_level));
+		put_str(&rc->rc_macros, mp->m_val);
+	}
+	rc->rc_nmacros++;
+}
+
+/*
+ * Note a macro used by the include file being recorded, unless the file
+ * has already used or assigned it.
+ */
+void
+macro_used(const char *name, struct macro *mp)
+{
+	struct recorder *rc = recorder;
+
+	if (rc && !rc->rc_invalid && !note_name(name))
+		note_macro(name, mp);
+}
+
+/*
+ * Record a macro assignment in the include file being recorded.  This
+ * is called before the assignment is made.  Whether it takes effect
+ * depends on the level of the macro, which may have been set from the
+ * command line or the environment, so unless the file has already used
+ * or assigned the macro its current state is noted.
+ */
+void
+record_macro(const char *name, const char *val, int level)
+{
+	struct recorder *rc = recorder;
+
+	if (!rc || rc->rc_invalid)
+		return;
+
+	if (!note_name(name))
+		note_macro(name, findmacro(name));
+	put(&rc->rc_ops, "m", 1);
+	put_str(&rc->rc_ops, name);
+	put_str(&rc->rc_ops, val);
+	put(&rc->rc_ops, &level, sizeof(level));
+	rc->rc_nops++;
+}
+
+/*
+ * Record a rule in the include file being recorded.  'nflag' holds the
+ * flags set on the target because of its type: if it's zero the target
+ * is a normal one.  If 'np' is NULL the rule had no targets.
+ */
+void
+record_rule(struct name *np, uint16_t nflag, struct depend *dp,
+				struct cmd *cp, int dbl)
+{
+	struct recorder *rc = recorder;
+	struct buffer *bp;
+	struct depend *d;
+	struct cmd *c;
+	uint32_t n;
+
+	if (!rc || rc->rc_invalid)
+		return;
+
+	bp = &rc->rc_ops;
+	put(bp, "r", 1);
+	put_str(bp, np ? np->n_name : NULL);
+	put(bp, &nflag, sizeof(nflag));
+	put(bp, &dbl, sizeof(dbl));
+	for (n = 0, d = dp; d; d = d->d_next)
+		n++;
+	put_u32(bp, n);
+	for (d = dp; d; d = d->d_next) {
+		uint16_t wait = d->d_name->n_flag & N_WAIT;
+
+		put_str(bp, d->d_name->n_name);
+		put(bp, &wait, sizeof(wait));
+	}
+	for (n = 0, c = cp; c; c = c->c_next)
+		n++;
+	put_u32(bp, n);
+	for (c = cp; c; c = c->c_next) {
+		put_str(bp, c->c_cmd);
+		put_str(bp, c->c_makefile);
+		put(bp, &c->c_dispno, sizeof(c->c_dispno));
+	}
+	rc->rc_nops++;
+}
+
+/*
+ * Note that reading the makefiles, and the include files currently
+ * being read, can't be cached.
+ */
+void
+disable_cache(void)
+{
+	cache_disabled = TRUE;
+	for (struct recorder *rc = recorder; rc; rc = rc->rc_parent)
+		rc->rc_invalid = TRUE;
+}
+
+static struct fragment *
+find_fragment(const char *name)
+{
+	struct fragment *fr;
+
+	for (fr = fraghead[getbucket(name)]; fr; fr = fr->fr_next) {
+		if (strcmp(name, fr->fr_name) == 0)
+			return fr;
+	}
+	return NULL;
+}
+
+/*
+ * Start recording the result of reading the include file which has
+ * just been opened.
+ */
+void
+begin_include(void)
+{
+	struct recorder *rc;
+
+	if (!cache_file)
+		return;
+
+	rc = xmalloc(sizeof(struct recorder));
+	memset(rc, 0, sizeof(struct recorder));
+	rc->rc_parent = recorder;
+	rc->rc_file = last_file;
+	rc->rc_opts = opts;
+	rc->rc_suffixes = suffix_key();
+	rc->rc_seen_first = seen_first;
+	recorder = rc;
+}
+
+/*
+ * Finish recording an include file and, if possible, keep the result
+ * to be saved in the cache file.  The result starts with the state
+ * which affects how the file is read.
+ */
+void
+end_include(void)
+{
+	struct recorder *rc = recorder;
+	struct cached_file *fp;
+	struct fragment *fr;
+	struct buffer *bp;
+
+	if (!rc)
+		return;
+	recorder = rc->rc_parent;
+	fp = rc->rc_file;
+
+	if (!rc->rc_invalid && !posix && opts == rc->rc_opts && !is_racy(fp)) {
+		if (!(fr = find_fragment(fp->f_name))) {
+			unsigned int bucket = getbucket(fp->f_name);
+
+			fr = xmalloc(sizeof(struct fragment));
+			memset(fr, 0, sizeof(struct fragment));
+			fr->fr_next = fraghead[bucket];
+			fraghead[bucket] = fr;
+			fr->fr_name = xstrdup(fp->f_name);
+		}
+		fr->fr_dev = fp->f_dev;
+		fr->fr_ino = fp->f_ino;
+		fr->fr_size = fp->f_size;
+		fr->fr_tim = fp->f_tim;
+
+		bp = &fr->fr_buf;
+		bp->b_len = 0;
+		put(bp, &rc->rc_opts, sizeof(rc->rc_opts));
+		put(bp, &pragma, sizeof(pragma));
+		put(bp, &posix_level, sizeof(posix_level));
+		put(bp, &rc->rc_suffixes, sizeof(rc->rc_suffixes));
+		put(bp, &rc->rc_seen_first, sizeof(rc->rc_seen_first));
+		put(bp, &seen_first, sizeof(seen_first));
+		put_u32(bp, rc->rc_nmacros);
+		put(bp, rc->rc_macros.b_buf, rc->rc_macros.b_len);
+		put_u32(bp, rc->rc_nops);
+		put(bp, rc->rc_ops.b_buf, rc->rc_ops.b_len);
+		fr->fr_data = bp->b_buf;
+		fr->fr_len = bp->b_len;
+		fr->fr_keep = TRUE;
+	}
+
+	for (size_t i = 0; i < rc->rc_nnames; i++)
+		free(rc->rc_names[i]);
+	free(rc->rc_names);
+	free(rc->rc_macros.b_buf);
+	free(rc->rc_ops.b_buf);
+	free(rc);
+}
+
+/*
+ * Check whether the state and macros used by an include file are as
+ * they were when it was recorded.
+ */
+static int
+same_macros(void)
+{
+	struct macro *mp;
+	const char *name;
+	uint32_t opts1;
+	uint64_t suffixes;
+	unsigned char pragma1, level1;
+	uint8_t mlevel;
+	bool first, first_after, exists, immediate;
+
+	get(&opts1, sizeof(opts1));
+	get(&pragma1, sizeof(pragma1));
+	get(&level1, sizeof(level1));
+	get(&suffixes, sizeof(suffixes));
+	get(&first, sizeof(first));
+	if (opts1 != opts || pragma1 != pragma || level1 != posix_level ||
+			suffixes != suffix_key() || first != seen_first)
+		return FALSE;
+	get(&first_after, sizeof(first_after));
+
+	for (uint32_t n = get_u32(); n; n--) {
+		name = get_str();
+		get(&exists, sizeof(exists));
+		mp = getmp(name);
+		if (!exists) {
+			if (mp)
+				return FALSE;
+			continue;
+		}
+		get(&immediate, sizeof(immediate));
+		get(&mlevel, sizeof(mlevel));
+		if (!mp || mp->m_immediate != immediate || mp->m_level != mlevel ||
+				strcmp(mp->m_val, get_str()) != 0)
+			return FALSE;
+	}
+	// The first line of the makefiles may have been in this file
+	seen_first = first_after;
+	return TRUE;
+}
+
+/*
+ * Repeat the macro assignments and rules of an include file.
+ */
+static void
+replay(void)
+{
+	struct name *np;
+	struct depend *dp, **dpp;
+	struct cmd *cp, **cpp;
+	const char *name, *val;
+	uint16_t nflag, wait;
+	int level, dbl;
+	char type;
+
+	for (uint32_t n = get_u32(); n; n--) {
+		get(&type, sizeof(type));
+		if (type == 'm') {
+			name = get_str();
+			val = get_str();
+			get(&level, sizeof(level));
+			setmacro(name, val, level);
+			continue;
+		}
+
+		name = get_str();
+		get(&nflag, sizeof(nflag));
+		get(&dbl, sizeof(dbl));
+		dpp = &dp;
+		for (uint32_t k = get_u32(); k; k--) {
+			*dpp = alloc_dep();
+			(*dpp)->d_name = newname(get_str());
+			(*dpp)->d_refcnt = 0;
+			get(&wait, sizeof(wait));
+			(*dpp)->d_name->n_flag |= wait;
+			dpp = &(*dpp)->d_next;
+		}
+		*dpp = NULL;
+		cpp = &cp;
+		for (uint32_t k = get_u32(); k; k--) {
+			*cpp = alloc_cmd();
+			(*cpp)->c_cmd = intern(get_str());
+			(*cpp)->c_refcnt = 0;
+			val = get_str();
+			(*cpp)->c_makefile = *val ? intern(val) : NULL;
+			get(&(*cpp)->c_dispno, sizeof((*cpp)->c_dispno));
+			cpp = &(*cpp)->c_next;
+		}
+		*cpp = NULL;
+
+		if (*name) {
+			np = newname(name);
+			np->n_flag |= nflag;
+			if (!nflag && !firstname)
+				firstname = np;
+			addrule(np, dp, cp, dbl);
+		} else {
+			freedeps(dp);
+			freecmds(cp);
+		}
+	}
+}
+
+/*
+ * Called before an include file is opened.  If the result of reading
+ * the file is in the cache, and still valid, replay it and return TRUE.
+ */
+int
+replay_include(const char *name)
+{
+	struct cached_file *fp = note_file(name);
+	struct fragment *fr;
+
+	// Files which include others aren't recorded
+	if (recorder)
+		recorder->rc_invalid = TRUE;
+
+	if (!fp || !fp->f_exists || !(fr = find_fragment(name)) ||
+			fr->fr_dev != fp->f_dev || fr->fr_ino != fp->f_ino ||
+			fr->fr_size != fp->f_size ||
+			fr->fr_tim.tv_sec != fp->f_tim.tv_sec ||
+			fr->fr_tim.tv_nsec != fp->f_tim.tv_nsec)
+		return FALSE;
+
+	rpos = fr->fr_data;
+	rend = fr->fr_data + fr->fr_len;
+	if (!same_macros())
+		return FALSE;
+	replay();
+	fr->fr_keep = TRUE;
+	return TRUE;
+}
+
+/*
+ * Check whether the makefiles recorded in the cache file are unchanged.
+ */
+static int
+files_unchanged(void)
+{
+	uint32_t count = get_u32();
+	const char *name;
+	struct stat st;
+	bool exists;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec tim;
+
+	while (count--) {
+		name = get_str();
+		get(&exists, sizeof(exists));
+		get(&dev, sizeof(dev));
+		get(&ino, sizeof(ino));
+		get(&size, sizeof(size));
+		get(&tim, sizeof(tim));
+		if (stat(name, &st) != 0) {
+			if (exists || errno != ENOENT)
+				return FALSE;
+		} else if (!exists || st.st_dev != dev || st.st_ino != ino ||
+				st.st_size != size || st.st_mtim.tv_sec != tim.tv_sec ||
+				st.st_mtim.tv_nsec != tim.tv_nsec) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Replace the names, rules and macros with those in the cache file.
+ * Names and macros are kept in the same order in their hash chains as
+ * when the makefiles were read.
+ */
+static void
+load_state(void)
+{
+	struct name *np, **npp, *oldnp;
+	struct macro *mp, **mpp, *oldmp;
+	struct rule *rp, **rpp;
+	struct depend *dp, **dpp;
+	struct cmd *cp, **cpp;
+	const char *name;
+	uint32_t *count, size, n, m;
+	unsigned char old_pragma = pragma, old_level = posix_level;
+
+	get(&opts, sizeof(opts));
+	get(&pragma, sizeof(pragma));
+	get(&posix_level, sizeof(posix_level));
+	if (pragma != old_pragma || posix_level != old_level)
+		pragmas_to_env();
+
+	// Names, reusing those which already exist.  Prerequisites may
+	// refer to any name so rules are added once all names are known.
+	// The table must have the same number of buckets as when saved.
+	size = get_u32();
+	if (size == 0 || (size & (size - 1)))
+		error("invalid cache file %s", cache_file);
+	if (size != namesize)
+		resize_names(size);
+	count = xmalloc(size * sizeof(uint32_t));
+	for (unsigned int i = 0; i < size; i++) {
+		oldnp = namehead[i];
+		npp = &namehead[i];
+		for (n = count[i] = get_u32(); n; n--) {
+			unsigned int hash = strhash(name = get_str());
+
+			if ((hash & (size - 1)) != i)
+				error("invalid cache file %s", cache_file);
+			for (struct name **pp = &oldnp; (np = *pp); pp = &np->n_next) {
+				if (np->n_hash == hash && strcmp(np->n_name, name) == 0) {
+					*pp = np->n_next;
+					break;
+				}
+			}
+			if (!np) {
+				np = arena_alloc(sizeof(struct name));
+				np->n_name = arena_strdup(name);
+				np->n_hash = hash;
+				np->n_rule = NULL;
+				np->n_last = NULL;
+				np->n_tim = (struct timespec){0, 0};
+				np->n_job = NULL;
+#if ENABLE_FEATURE_MAKE_PREFETCH
+				np->n_prefetch = FALSE;
+#endif
+				namecount++;
+			}
+			get(&np->n_flag, sizeof(np->n_flag));
+			*npp = np;
+			npp = &np->n_next;
+		}
+		*npp = oldnp;
+	}
+
+	for (unsigned int i = 0; i < size; i++) {
+		np = namehead[i];
+		for (n = count[i]; n; n--, np = np->n_next) {
+			freerules(np->n_rule);
+			rpp = &np->n_rule;
+			for (m = get_u32(); m; m--) {
+				rp = alloc_rule();
+				dpp = &rp->r_dep;
+				for (uint32_t k = get_u32(); k; k--) {
+					dp = alloc_dep();
+					name = get_str();
+					if (!(dp->d_name = findname(name)))
+						error("invalid cache file %s", cache_file);
+					dp->d_refcnt = 0;
+					*dpp = dp;
+					dpp = &dp->d_next;
+				}
+				*dpp = NULL;
+				cpp = &rp->r_cmd;
+				for (uint32_t k = get_u32(); k; k--) {
+					cp = alloc_cmd();
+					cp->c_cmd = intern(get_str());
+					cp->c_refcnt = 0;
+					name = get_str();
+					cp->c_makefile = *name ? intern(name) : NULL;
+					get(&cp->c_dispno, sizeof(cp->c_dispno));
+					*cpp = cp;
+					cpp = &cp->c_next;
+				}
+				*cpp = NULL;
+				if (rp->r_dep)
+					rp->r_dep->d_refcnt = 1;
+				if (rp->r_cmd)
+					rp->r_cmd->c_refcnt = 1;
+				*rpp = np->n_last = rp;
+				rpp = &rp->r_next;
+			}
+			*rpp = NULL;
+		}
+	}
+	free(count);
+	name = get_str();
+	firstname = *name ? findname(name) : NULL;
+
+	// Macros, likewise
+	size = get_u32();
+	if (size == 0 || (size & (size - 1)))
+		error("invalid cache file %s", cache_file);
+	if (size != macrosize)
+		resize_macros(size);
+	for (unsigned int i = 0; i < size; i++) {
+		oldmp = macrohead[i];
+		mpp = &macrohead[i];
+		for (n = get_u32(); n; n--) {
+			unsigned int hash = strhash(name = get_str());
+
+			if ((hash & (size - 1)) != i)
+				error("invalid cache file %s", cache_file);
+			for (struct macro **pp = &oldmp; (mp = *pp); pp = &mp->m_next) {
+				if (mp->m_hash == hash && strcmp(mp->m_name, name) == 0) {
+					*pp = mp->m_next;
+					free(mp->m_val);
+					break;
+				}
+			}
+			if (!mp) {
+				mp = arena_alloc(sizeof(struct macro));
+				mp->m_name = arena_strdup(name);
+				mp->m_hash = hash;
+				mp->m_flag = FALSE;
+				macrocount++;
+			}
+			mp->m_val = xstrdup(get_str());
+			get(&mp->m_level, sizeof(mp->m_level));
+			get(&mp->m_immediate, sizeof(mp->m_immediate));
+			*mpp = mp;
+			mpp = &mp->m_next;
+		}
+		*mpp = oldmp;
+	}
+}
+
+/*
+ * Take note of the include files in the cache file.  Their results
+ * remain in the mapped file.
+ */
+static void
+load_fragments(void)
+{
+	struct fragment *fr;
+	unsigned int bucket;
+
+	for (uint32_t n = get_u32(); n; n--) {
+		fr = xmalloc(sizeof(struct fragment));
+		memset(fr, 0, sizeof(struct fragment));
+		fr->fr_name = xstrdup(get_str());
+		get(&fr->fr_dev, sizeof(fr->fr_dev));
+		get(&fr->fr_ino, sizeof(fr->fr_ino));
+		get(&fr->fr_size, sizeof(fr->fr_size));
+		get(&fr->fr_tim, sizeof(fr->fr_tim));
+		fr->fr_len = get_u32();
+		fr->fr_data = skip(fr->fr_len);
+
+		bucket = getbucket(fr->fr_name);
+		fr->fr_next = fraghead[bucket];
+		fraghead[bucket] = fr;
+	}
+}
+
+static void
+free_fragments(void)
+{
+	struct fragment *fr, *next;
+
+	for (int i = 0; i < HTABSIZE; i++) {
+		for (fr = fraghead[i]; fr; fr = next) {
+			next = fr->fr_next;
+			free(fr->fr_name);
+			free(fr->fr_buf.b_buf);
+			free(fr);
+		}
+		fraghead[i] = NULL;
+	}
+	if (cache_map != MAP_FAILED) {
+		munmap(cache_map, cache_size);
+		cache_map = MAP_FAILED;
+	}
+}
+
+/*
+ * If the PDPMAKE_CACHE macro names a cache file which is valid for the
+ * current state and makefiles, load the result of reading the makefiles
+ * from it.  Return TRUE if the makefiles needn't be read.  Otherwise
+ * the include files in the cache file are available to be replayed.
+ */
+int
+load_cache(void)
+{
+	struct stat st;
+	uint64_t key, sum;
+	bool has_state;
+	int fd;
+
+	if (posix)
+		return FALSE;
+
+	cache_file = expand_macros("$(PDPMAKE_CACHE)", FALSE);
+	if (!*cache_file) {
+		free(cache_file);
+		cache_file = NULL;
+		return FALSE;
+	}
+	cache_key = state_key();
+
+	if ((fd = open(cache_file, O_RDONLY | O_CLOEXEC)) < 0)
+		return FALSE;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size > 3 * sizeof(key)) {
+		cache_size = st.st_size;
+		cache_map = mmap(NULL, cache_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (cache_map == MAP_FAILED)
+		return FALSE;
+
+	rpos = cache_map + sizeof(magic);
+	rend = cache_map + cache_size;
+	get(&key, sizeof(key));
+	get(&sum, sizeof(sum));
+	if (memcmp(cache_map, magic, sizeof(magic)) != 0 ||
+			sum != hash(FNV_OFFSET, rpos, rend - rpos)) {
+		free_fragments();
+		return FALSE;
+	}
+
+	load_fragments();
+	if (key == cache_key && files_unchanged()) {
+		get(&has_state, sizeof(has_state));
+		if (has_state) {
+			load_state();
+			seen_first = TRUE;
+			free_fragments();
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Write the names, rules and macros to the buffer.
+ */
+static void
+save_state(struct buffer *bp)
+{
+	struct name *np;
+	struct macro *mp;
+	struct rule *rp;
+	struct depend *dp;
+	struct cmd *cp;
+	uint32_t n;
+
+	put(bp, &opts, sizeof(opts));
+	put(bp, &pragma, sizeof(pragma));
+	put(bp, &posix_level, sizeof(posix_level));
+
+	put_u32(bp, namesize);
+	for (unsigned int i = 0; i < namesize; i++) {
+		for (n = 0, np = namehead[i]; np; np = np->n_next)
+			n++;
+		put_u32(bp, n);
+		for (np = namehead[i]; np; np = np->n_next) {
+			// Include files may have been looked at
+			uint16_t flag = np->n_flag & ~(N_DOING | N_DONE);
+
+			put_str(bp, np->n_name);
+			put(bp, &flag, sizeof(flag));
+		}
+	}
+
+	for (unsigned int i = 0; i < namesize; i++) {
+		for (np = namehead[i]; np; np = np->n_next) {
+			for (n = 0, rp = np->n_rule; rp; rp = rp->r_next)
+				n++;
+			put_u32(bp, n);
+			for (rp = np->n_rule; rp; rp = rp->r_next) {
+				for (n = 0, dp = rp->r_dep; dp; dp = dp->d_next)
+					n++;
+				put_u32(bp, n);
+				for (dp = rp->r_dep; dp; dp = dp->d_next)
+					put_str(bp, dp->d_name->n_name);
+				for (n = 0, cp = rp->r_cmd; cp; cp = cp->c_next)
+					n++;
+				put_u32(bp, n);
+				for (cp = rp->r_cmd; cp; cp = cp->c_next) {
+					put_str(bp, cp->c_cmd);
+					put_str(bp, cp->c_makefile);
+					put(bp, &cp->c_dispno, sizeof(cp->c_dispno));
+				}
+			}
+		}
+	}
+	put_str(bp, firstname ? firstname->n_name : NULL);
+
+	put_u32(bp, macrosize);
+	for (unsigned int i = 0; i < macrosize; i++) {
+		for (n = 0, mp = macrohead[i]; mp; mp = mp->m_next)
+			n++;
+		put_u32(bp, n);
+		for (mp = macrohead[i]; mp; mp = mp->m_next) {
+			put_str(bp, mp->m_name);
+			put_str(bp, mp->m_val);
+			put(bp, &mp->m_level, sizeof(mp->m_level));
+			put(bp, &mp->m_immediate, sizeof(mp->m_immediate));
+		}
+	}
+}
+
+/*
+ * Save the result of reading the makefiles, and of reading each
+ * include file which could be recorded, to the cache file, if there is
+ * one.  The file is replaced atomically so a concurrent instance of make
+ * sees either the old or the new version.
+ */
+void
+save_cache(void)
+{
+	struct cached_file *fp, *next;
+	struct fragment *fr;
+	struct buffer *bp = &wbuf;
+	uint32_t nfrags = 0, nfiles = 0;
+	uint64_t sum;
+	bool has_state = !cache_disabled;
+	char *tmp;
+	int fd;
+
+	if (!cache_file || posix)
+		goto end;
+
+	for (fp = cached_files; fp; fp = fp->f_next) {
+		if (is_racy(fp))
+			has_state = FALSE;
+		nfiles++;
+	}
+	for (int i = 0; i < HTABSIZE; i++) {
+		for (fr = fraghead[i]; fr; fr = fr->fr_next)
+			nfrags += fr->fr_keep;
+	}
+	if (!has_state && nfrags == 0)
+		goto end;
+
+	bp->b_len = 0;
+	put(bp, magic, sizeof(magic));
+	put(bp, &cache_key, sizeof(cache_key));
+	put(bp, &cache_key, sizeof(cache_key));	// Space for the checksum
+	put_u32(bp, nfrags);
+	for (int i = 0; i < HTABSIZE; i++) {
+		for (fr = fraghead[i]; fr; fr = fr->fr_next) {
+			if (!fr->fr_keep)
+				continue;
+			put_str(bp, fr->fr_name);
+			put(bp, &fr->fr_dev, sizeof(fr->fr_dev));
+			put(bp, &fr->fr_ino, sizeof(fr->fr_ino));
+			put(bp, &fr->fr_size, sizeof(fr->fr_size));
+			put(bp, &fr->fr_tim, sizeof(fr->fr_tim));
+			put_u32(bp, fr->fr_len);
+			put(bp, fr->fr_data, fr->fr_len);
+		}
+	}
+	put_u32(bp, nfiles);
+	for (fp = cached_files; fp; fp = fp->f_next) {
+		put_str(bp, fp->f_name);
+		put(bp, &fp->f_exists, sizeof(fp->f_exists));
+		put(bp, &fp->f_dev, sizeof(fp->f_dev));
+		put(bp, &fp->f_ino, sizeof(fp->f_ino));
+		put(bp, &fp->f_size, sizeof(fp->f_size));
+		put(bp, &fp->f_tim, sizeof(fp->f_tim));
+	}
+	put(bp, &has_state, sizeof(has_state));
+	if (has_state)
+		save_state(bp);
+	sum = hash(FNV_OFFSET, bp->b_buf + 3 * sizeof(sum),
+				bp->b_len - 3 * sizeof(sum));
+	memcpy(bp->b_buf + 2 * sizeof(sum), &sum, sizeof(sum));
+
+	tmp = xconcat3(cache_file, ".tmp", "");
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) >= 0) {
+		size_t nwritten = 0;
+		ssize_t n;
+
+		while (nwritten < bp->b_len) {
+			if ((n = write(fd, bp->b_buf + nwritten,
+							bp->b_len - nwritten)) < 0) {
+				if (errno != EINTR)
+					break;
+				n = 0;
+			}
+			nwritten += n;
+		}
+		if (close(fd) == 0 && nwritten == bp->b_len &&
+				rename(tmp, cache_file) == 0)
+			goto done;
+		unlink(tmp);
+	}
+	warning("can't write %s: %s", cache_file, strerror(errno));
+ done:
+	free(tmp);
+	free(bp->b_buf);
+	bp->b_buf = NULL;
+	bp->b_size = 0;
+ end:
+	for (fp = cached_files; fp; fp = next) {
+		next = fp->f_next;
+		free(fp->f_name);
+		free(fp);
+	}
+	cached_files = NULL;
+	cached_tail = &cached_files;
+	free_fragments();
+}
+
+#if ENABLE_FEATURE_CLEAN_UP
+void
+free_cache(void)
+{
+	free(cache_file);
+}
+#endif
+#endif
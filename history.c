@@ -0,0 +1,239 @@
+/*
+ * Keep a history of the commands run to make targets
+ */
+#include "make.h"
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+// If the PDPMAKE_HISTORY macro names a file, such as .pdpmake.db, a
+// record is appended to it each time the commands for a target have
+// been run.  Each record is a line of fields separated by spaces:
+//
+//   checksum msecs status utime stime target prerequisite...
+//
+// The checksum, a 32-bit FNV-1a hash in hex, covers the rest of the
+// line so a record left incomplete by a crash is ignored.  The latest
+// record for a target is the one that counts, though the time taken is
+// that of the latest run which succeeded.  Times are in milliseconds.
+struct history {
+	struct history *h_next;	// Next history entry in this bucket
+	char *h_name;			// Name of target
+	char *h_record;			// Latest record for target
+	unsigned long h_time;	// Time taken by commands that succeeded
+};
+
+char *history_file;
+static struct history *histhead[HTABSIZE];
+static int history_fd = -1;
+static bool need_newline;	// History file doesn't end with a newline
+
+static struct history *
+find_history(const char *name)
+{
+	struct history *hp;
+
+	for (hp = histhead[getbucket(name)]; hp; hp = hp->h_next) {
+		if (strcmp(name, hp->h_name) == 0)
+			return hp;
+	}
+	return NULL;
+}
+
+/*
+ * Return the time taken by the commands for a target when it was last
+ * made, or 0 if it isn't known.
+ */
+unsigned long
+target_time(const char *name)
+{
+	struct history *hp;
+
+	if (!history_file || !(hp = find_history(name)))
+		return 0;
+	return hp->h_time;
+}
+
+/*
+ * Make a record the latest for a target.  The record is taken over by
+ * the history.  The time taken by commands which failed isn't kept:
+ * they may have stopped early.
+ */
+static void
+add_history(const char *name, char *record, unsigned long msecs, int status)
+{
+	struct history *hp;
+	unsigned int bucket;
+
+	if (!(hp = find_history(name))) {
+		bucket = getbucket(name);
+		hp = xmalloc(sizeof(struct history));
+		hp->h_next = histhead[bucket];
+		histhead[bucket] = hp;
+		hp->h_name = xstrdup(name);
+		hp->h_record = NULL;
+		hp->h_time = 0;
+	}
+	free(hp->h_record);
+	hp->h_record = record;
+	if (status == 0)
+		hp->h_time = msecs;
+}
+
+/*
+ * Check a line read from the history file and, if it's a valid record,
+ * add it to the history.
+ */
+static void
+parse_record(char *line)
+{
+	unsigned long sum, msecs;
+	char *s, *name;
+	int status, n = -1;
+
+	line[strcspn(line, "\n")] = '\0';
+	sum = strtoul(line, &s, 16);
+	if (s != line + 8 || *s++ != ' ' || sum != fnv1a(s))
+		return;
+	if (sscanf(s, "%lu %d %*u %*u %n", &msecs, &status, &n) < 2 || n < 0 ||
+			s[n] == '\0' || s[n] == ' ')
+		return;
+
+	name = xstrndup(s + n, strcspn(s + n, " "));
+	add_history(name, xstrdup(line), msecs, status);
+	free(name);
+}
+
+/*
+ * Replace the history file with one containing only the latest record
+ * for each target.  A record appended by another instance of make while
+ * this is happening may be lost.
+ */
+static void
+compact_history(void)
+{
+	struct history *hp;
+	char *tmp;
+	FILE *fp;
+	int i;
+
+	tmp = xconcat3(history_file, ".tmp", "");
+	if ((fp = fopen(tmp, "w")) != NULL) {
+		for (i = 0; i < HTABSIZE; i++) {
+			for (hp = histhead[i]; hp; hp = hp->h_next)
+				fprintf(fp, "%s\n", hp->h_record);
+		}
+		if (fclose(fp) == 0 && rename(tmp, history_file) == 0)
+			need_newline = FALSE;
+		else
+			unlink(tmp);
+	}
+	free(tmp);
+}
+
+/*
+ * Read the history file named by PDPMAKE_HISTORY, if any.  Invalid
+ * records are ignored.  If most records are obsolete or invalid the
+ * file is compacted.
+ */
+void
+read_history(void)
+{
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t n;
+	int records = 0, targets = 0;
+	FILE *fp;
+
+	history_file = expand_macros("$(PDPMAKE_HISTORY)", FALSE);
+	if (!*history_file) {
+		free(history_file);
+		history_file = NULL;
+		return;
+	}
+
+	if ((fp = fopen(history_file, "r")) != NULL) {
+		while ((n = getline(&line, &len, fp)) > 0) {
+			need_newline = line[n - 1] != '\n';
+			records++;
+			parse_record(line);
+		}
+		free(line);
+		fclose(fp);
+
+		for (int i = 0; i < HTABSIZE; i++) {
+			for (struct history *hp = histhead[i]; hp; hp = hp->h_next)
+				targets++;
+		}
+		if (records > 256 && records > 2 * targets)
+			compact_history();
+	}
+}
+
+/*
+ * Append a record of the commands run for a target to the history.
+ * 'status' is the exit status of the command that failed, or 0, and
+ * 'prereqs' is a space-separated list of prerequisites.  The record is
+ * written with a single call to write(2) to a file opened for appending
+ * so records from different instances of make aren't mixed.
+ */
+void
+record_target(const char *name, unsigned long msecs, int status,
+				unsigned long utime, unsigned long stime, const char *prereqs)
+{
+	char *fields, *record, *buf, *s;
+	size_t len;
+	ssize_t n;
+
+	if (history_fd == -1) {
+		history_fd = open(history_file,
+							O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+		if (history_fd < 0) {
+			warning("can't write %s: %s", history_file, strerror(errno));
+			history_fd = -2;
+		}
+	}
+
+	len = strlen(name) + (prereqs ? strlen(prereqs) : 0) + 80;
+	fields = xmalloc(len);
+	snprintf(fields, len, "%lu %d %lu %lu %s%s%s", msecs, status, utime,
+				stime, name, prereqs && *prereqs ? " " : "",
+				prereqs ? prereqs : "");
+	record = xmalloc(len + 9);
+	sprintf(record, "%08lx %s", (unsigned long)fnv1a(fields), fields);
+	free(fields);
+
+	if (history_fd >= 0) {
+		// An incomplete record mustn't swallow this one
+		buf = xconcat3(need_newline ? "\n" : "", record, "\n");
+		need_newline = FALSE;
+		for (s = buf, len = strlen(buf); len > 0; s += n, len -= n) {
+			if ((n = write(history_fd, s, len)) < 0) {
+				if (errno != EINTR)
+					break;
+				n = 0;
+			}
+		}
+		free(buf);
+	}
+	add_history(name, record, msecs, status);
+}
+
+#if ENABLE_FEATURE_CLEAN_UP
+void
+free_history(void)
+{
+	struct history *hp, *next;
+
+	for (int i = 0; i < HTABSIZE; i++) {
+		for (hp = histhead[i]; hp; hp = next) {
+			next = hp->h_next;
+			free(hp->h_name);
+			free(hp->h_record);
+			free(hp);
+		}
+	}
+	if (history_fd >= 0)
+		close(history_fd);
+	free(history_file);
+}
+#endif
+#endif
@@ -73,13 +73,14 @@ modify_words(const char *val, int modifier, size_t lenf, size_t lenr,
 				const char *find_pref, const char *repl_pref,
 				const char *find_suff, const char *repl_suff)
 {
-	char *s, *copy, *word, *sep, *newword, *buf = NULL;
+	char *s, *copy, *word, *sep, *newword;
+	struct words buf = {NULL, 0, 0};
 #if ENABLE_FEATURE_MAKE_POSIX_2024
 	size_t find_pref_len = 0, find_suff_len = 0;
 #endif
 
 	if (!modifier && lenf == 0 && lenr == 0)
-		return buf;
+		return NULL;
 
 #if ENABLE_FEATURE_MAKE_POSIX_2024
 	if (find_pref) {
@@ -145,11 +146,11 @@ modify_words(const char *val, int modifier, size_t lenf, size_t lenr,
 				word = newword = xconcat3(word, repl_suff, "");
 			}
 		}
-		buf = xappendword(buf, word);
+		addword(&buf, word);
 		free(newword);
 	}
 	free(copy);
-	return buf;
+	return buf.w_buf;
 }
 
 /*
@@ -650,20 +651,24 @@ readline(FILE *fd, int want_command)
 
 /*
  * Return a pointer to the suffix name if the argument is a known suffix
- * or NULL if it isn't.
+ * or NULL if it isn't.  Suffixes are names, so they're compared by
+ * pointer.
  */
 const char *
 is_suffix(const char *s)
 {
-	struct name *np;
+	struct name *np, *sp;
 	struct rule *rp;
 	struct depend *dp;
 
+	if (!(sp = findname(s)))
+		return NULL;
+
 	np = newname(".SUFFIXES");
 	for (rp = np->n_rule; rp; rp = rp->r_next) {
 		for (dp = rp->r_dep; dp; dp = dp->d_next) {
-			if (strcmp(s, dp->d_name->n_name) == 0) {
-				return dp->d_name->n_name;
+			if (dp->d_name == sp) {
+				return sp->n_name;
 			}
 		}
 	}
@@ -734,6 +739,11 @@ target_type(char *s)
 #endif
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 		".PRAGMA",
+		".ONESHELL",
+		".PERSISTENT_SHELL",
+		".OUTPUT_SYNC",
+		".OUTPUT_SYNC_LINE",
+		".BATCH_ARCHIVES",
 #endif
 	};
 
@@ -751,6 +761,11 @@ target_type(char *s)
 #endif
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 		T_SPECIAL,
+		T_SPECIAL,
+		T_SPECIAL | T_NOPREREQ,
+		T_SPECIAL,
+		T_SPECIAL,
+		T_SPECIAL,
 #endif
 	};
 
@@ -881,6 +896,8 @@ run_command(const char *cmd)
 		val[len] = '\0';
 	}
 	pclose(fd);
+	files_changed();
+	IF_FEATURE_MAKE_EXTENSIONS(disable_cache();)
 
 	if (val == NULL)
 		return val;
@@ -961,6 +978,8 @@ wildcard(char *p, glob_t *gd)
 		return 0;
 	}
 
+	// The files matched may change
+	disable_cache();
 	memset(gd, 0, sizeof(*gd));
 	ret = glob(p, GLOB_NOSORT, NULL, gd);
 	if (ret == GLOB_NOMATCH) {
@@ -1011,8 +1030,8 @@ input(FILE *fd, int ilevel)
 	char *p, *q, *s, *a, *str, *expanded, *copy;
 	char *str1, *str2;
 	struct name *np;
-	struct depend *dp;
-	struct cmd *cp;
+	struct depend *dp, **dpp;
+	struct cmd *cp, **cpp;
 	int startno, count;
 	bool semicolon_cmd, seen_inference;
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -1076,16 +1095,31 @@ input(FILE *fd, int ilevel)
 				if (!POSIX_2017) {
 					// Try to create include file or bring it up-to-date
 					opts |= OPT_include;
-					make(newname(p), 1);
+					np = newname(p);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+					// An include file which can be made mustn't
+					// be taken from the cache.
+					if ((make(np, 1) & MAKE_DIDSOMETHING) || np->n_rule)
+						disable_cache();
+#else
+					make(np, 1);
+#endif
 					opts &= ~OPT_include;
 				}
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+				if (replay_include(p)) {
+					// File is unchanged since it was cached
+				} else
 #endif
 				if ((ifd = fopen(p, "r")) == NULL) {
 					if (!minus)
 						error("can't open include file '%s'", p);
 				} else {
 					makefile = p;
+					IF_FEATURE_MAKE_EXTENSIONS(begin_include();)
 					input(ifd, ilevel + 1);
+					IF_FEATURE_MAKE_EXTENSIONS(end_include();)
 					fclose(ifd);
 					makefile = old_makefile;
 					lineno = old_lineno;
@@ -1233,6 +1267,7 @@ input(FILE *fd, int ilevel)
 			}
 # endif
 #endif
+			IF_FEATURE_MAKE_EXTENSIONS(record_macro(a, q, level);)
 			setmacro(a, q, level);
 #if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
 			free(newq);
@@ -1263,12 +1298,13 @@ input(FILE *fd, int ilevel)
 
 		// Look for semicolon separator
 		cp = NULL;
+		cpp = &cp;
 		s = strchr(q, ';');
 		if (s) {
 			// Retrieve command from original or expanded copy of line
 			char *copy3 = expand_macros(copy, FALSE);
 			if ((p = inline_command(copy)) || (p = inline_command(copy3)))
-				cp = newcmd(process_command(p + 1), cp);
+				cpp = newcmd(process_command(p + 1), cpp);
 			free(copy3);
 			*s = '\0';
 		}
@@ -1276,14 +1312,15 @@ input(FILE *fd, int ilevel)
 
 		// Create list of prerequisites
 		dp = NULL;
+		dpp = &dp;
 		while (((p = gettok(&q)) != NULL)) {
 #if !ENABLE_FEATURE_MAKE_EXTENSIONS
+			np = newname(p);
 # if ENABLE_FEATURE_MAKE_POSIX_2024
 			if (!POSIX_2017 && strcmp(p, ".WAIT") == 0)
-				continue;
+				np->n_flag |= N_WAIT;
 # endif
-			np = newname(p);
-			dp = newdep(np, dp);
+			dpp = newdep(np, dpp);
 #else
 			char *newp = NULL;
 
@@ -1322,12 +1359,12 @@ input(FILE *fd, int ilevel)
 				files = gd.gl_pathv;
 			}
 			for (i = 0; i < nfile; ++i) {
+				np = newname(files[i]);
 # if ENABLE_FEATURE_MAKE_POSIX_2024
 				if (!POSIX_2017 && strcmp(files[i], ".WAIT") == 0)
-					continue;
+					np->n_flag |= N_WAIT;
 # endif
-				np = newname(files[i]);
-				dp = newdep(np, dp);
+				dpp = newdep(np, dpp);
 			}
 			if (files != &p)
 				globfree(&gd);
@@ -1341,7 +1378,7 @@ input(FILE *fd, int ilevel)
 		// Create list of commands
 		startno = dispno;
 		while ((str2 = readline(fd, TRUE)) && *str2 == '\t') {
-			cp = newcmd(process_command(str2), cp);
+			cpp = newcmd(process_command(str2), cpp);
 			free(str2);
 		}
 		dispno = startno;
@@ -1364,6 +1401,7 @@ input(FILE *fd, int ilevel)
 #endif
 			{
 				int ttype = target_type(p);
+				uint16_t nflag = 0;
 
 				np = newname(p);
 				if (ttype != T_NORMAL) {
@@ -1384,18 +1422,20 @@ input(FILE *fd, int ilevel)
 					}
 
 					if ((ttype & T_INFERENCE)) {
-						np->n_flag |= N_INFERENCE;
+						nflag = N_INFERENCE;
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 					} else if (strcmp(p, ".DEFAULT") == 0) {
 						// .DEFAULT rule is a special case
-						np->n_flag |= N_SPECIAL | N_INFERENCE;
+						nflag = N_SPECIAL | N_INFERENCE;
 #endif
 					} else {
-						np->n_flag |= N_SPECIAL;
+						nflag = N_SPECIAL;
 					}
+					np->n_flag |= nflag;
 				} else if (!firstname) {
 					firstname = np;
 				}
+				IF_FEATURE_MAKE_EXTENSIONS(record_rule(np, nflag, dp, cp, dbl);)
 				addrule(np, dp, cp, dbl);
 				count++;
 			}
@@ -1411,6 +1451,7 @@ input(FILE *fd, int ilevel)
 		// Prerequisites and commands will be unused if there were
 		// no targets.  Avoid leaking memory.
 		if (count == 0) {
+			IF_FEATURE_MAKE_EXTENSIONS(record_rule(NULL, 0, dp, NULL, FALSE);)
 			freedeps(dp);
 			freecmds(cp);
 		}
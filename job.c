@@ -0,0 +1,966 @@
+/*
+ * Run commands in the background for parallel builds
+ */
+#include "make.h"
+
+int maxjobs = 1;		// Maximum number of commands to run at once
+static int nchild;		// Number of commands running
+static struct sigaction old_int, old_quit;
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+// With .PERSISTENT_SHELL command lines which need a shell are passed
+// to long-running shells, at most one for each job slot.  Each command
+// is run in a subshell and its exit status is written to a pipe.
+struct shell {
+	struct shell *sh_next;	// Next shell
+	pid_t sh_pid;			// Process ID of shell
+	int sh_in;				// Commands are written to this
+	int sh_out;				// Exit status is read from this
+	bool sh_busy;			// Shell is running a command
+};
+static struct shell *shells;
+static bool persist;		// Use persistent shells
+
+// With .OUTPUT_SYNC the output of commands run in the background is
+// collected in temporary files and copied to make's own output when
+// the target, or the command line, is done.  The files are reused.
+static int *spare_output;	// Temporary files not in use
+static int nspare;
+static bool same_output;	// Standard output and error are the same file
+
+// With -l commands aren't started while the load average, or the CPU
+// pressure reported by Linux, is too high, unless none are running.
+static double max_load = -1;	// Maximum load, or -1 if there's no limit
+static bool cpu_pressure;		// Limit is a percentage of CPU pressure
+static bool overloaded;			// A command was held back by the load
+static int recent;				// Commands started since load was read
+
+// CPU time used by the command most recently waited for, in milliseconds
+static unsigned long last_utime, last_stime;
+#endif
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
+static void
+sigchld_handler(int sig)
+{
+	(void)sig;
+}
+
+/*
+ * Arrange for SIGCHLD to interrupt pselect(2) while we wait for
+ * something other than a child process to exit.
+ */
+static void
+catch_sigchld(void)
+{
+	struct sigaction sa;
+
+	sa.sa_handler = sigchld_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGCHLD, &sa, NULL);
+}
+#endif
+
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+// The jobserver is a pipe or FIFO holding a token for each job slot
+// shared by recursive invocations of make.  Every make has one implicit
+// slot.  The same protocol is used by GNU make.
+char *jobserver_auth;	// Jobserver details from MAKEFLAGS
+static int js_read = -1, js_write = -1;
+static bool js_fifo;	// Jobserver is a named FIFO
+static int tokens;		// Number of tokens taken from the jobserver
+
+/*
+ * Set or clear the close-on-exec flag of the jobserver file descriptors.
+ */
+static void
+set_cloexec(int flag)
+{
+	fcntl(js_read, F_SETFD, flag);
+	fcntl(js_write, F_SETFD, flag);
+}
+
+/*
+ * Write a token to the jobserver.
+ */
+static void
+put_token(void)
+{
+	while (write(js_write, "+", 1) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Return tokens to the jobserver when make exits.
+ */
+static void
+return_tokens(void)
+{
+	for (; tokens > 0; tokens--)
+		put_token();
+}
+
+/*
+ * Connect to the jobserver advertised in MAKEFLAGS, either a named
+ * FIFO ('fifo:PATH') or a pair of inherited file descriptors ('R,W').
+ * Return FALSE if it can't be used.
+ */
+static int
+connect_jobserver(const char *auth)
+{
+	if (strncmp(auth, "fifo:", 5) == 0) {
+		js_fifo = TRUE;
+		js_read = open(auth + 5, O_RDONLY | O_NONBLOCK);
+		if (js_read >= 0 && (js_write = open(auth + 5, O_WRONLY)) >= 0)
+			return TRUE;
+		if (js_read >= 0)
+			close(js_read);
+	} else if (sscanf(auth, "%d,%d", &js_read, &js_write) == 2 &&
+				fcntl(js_read, F_GETFD) >= 0 &&
+				fcntl(js_write, F_GETFD) >= 0) {
+		return TRUE;
+	}
+	js_read = js_write = -1;
+	js_fifo = FALSE;
+	return FALSE;
+}
+
+/*
+ * Set up a jobserver or connect to the one advertised in MAKEFLAGS.
+ * A make connected to a jobserver is only limited by the number of
+ * tokens available.
+ */
+static void
+init_jobserver(void)
+{
+	char *makeflags, *auth;
+	int fd[2];
+
+	if (jobserver_auth) {
+		if (!connect_jobserver(jobserver_auth)) {
+			warning("jobserver unavailable: using -j1");
+			free(jobserver_auth);
+			jobserver_auth = NULL;
+			maxjobs = 1;
+			return;
+		}
+		maxjobs = INT_MAX;
+	} else {
+		if (maxjobs == 1)
+			return;
+		// Writing the tokens mustn't fill the pipe
+		if (maxjobs > PIPE_BUF)
+			maxjobs = PIPE_BUF;
+		if (pipe(fd) < 0)
+			error("can't create jobserver: %s", strerror(errno));
+		// Standard input may have been closed after reading a makefile:
+		// keep the pipe clear of the standard descriptors.
+		js_read = fcntl(fd[0], F_DUPFD, 3);
+		js_write = fcntl(fd[1], F_DUPFD, 3);
+		close(fd[0]);
+		close(fd[1]);
+		if (js_read < 0 || js_write < 0)
+			error("can't create jobserver: %s", strerror(errno));
+		for (int i = 1; i < maxjobs; i++)
+			put_token();
+		jobserver_auth = xmalloc(32);
+		sprintf(jobserver_auth, "%d,%d", js_read, js_write);
+	}
+	fcntl(js_read, F_SETFL, fcntl(js_read, F_GETFL) | O_NONBLOCK);
+	set_cloexec(FD_CLOEXEC);
+
+	catch_sigchld();
+	atexit(return_tokens);
+
+	// Advertise the jobserver to recursive invocations of make
+	auth = xconcat3("--jobserver-auth=", jobserver_auth, "");
+	makeflags = getenv("MAKEFLAGS");
+	makeflags = xappendword(makeflags ? xstrdup(makeflags) : NULL, auth);
+	setmacro("MAKEFLAGS", makeflags, 0);
+	setenv("MAKEFLAGS", makeflags, 1);
+	free(makeflags);
+	free(auth);
+	free(jobserver_auth);
+	jobserver_auth = NULL;
+}
+
+/*
+ * Commands that invoke make share the jobserver's file descriptors,
+ * others don't see them.  A FIFO is opened by name so isn't shared.
+ */
+void
+share_jobserver(int share)
+{
+	if (js_read >= 0 && !js_fifo)
+		set_cloexec(share ? 0 : FD_CLOEXEC);
+}
+#endif
+
+/*
+ * Determine how many commands may be run at once.
+ */
+void
+init_jobs(void)
+{
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+	if (numjobs) {
+		long n = strtol(numjobs, NULL, 10);
+
+		maxjobs = n < 1 ? 1 : n > INT_MAX ? INT_MAX : n;
+	}
+	init_jobserver();
+
+	// .NOTPARALLEL forces a serial build.  Recursive invocations of
+	// make can still use the jobserver.
+	if (findname(".NOTPARALLEL"))
+		maxjobs = 1;
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if (!posix && findname(".PERSISTENT_SHELL")) {
+		persist = TRUE;
+		catch_sigchld();
+	}
+	if (!posix && maxload) {
+		char *end;
+
+		max_load = strtod(maxload, &end);
+		cpu_pressure = *end == '%';
+		catch_sigchld();
+	}
+	if (!posix && maxjobs > 1) {
+		struct stat st1, st2;
+
+		same_output = fstat(1, &st1) == 0 && fstat(2, &st2) == 0 &&
+				st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+	}
+#endif
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Return the load average or, if the limit is a percentage, the share
+ * of the last ten seconds in which tasks were waiting for a CPU.  The
+ * value is read at most once a second.  A load average is slow to
+ * reflect new commands so those started since are added to it.  If
+ * the value can't be read 0 is returned.
+ */
+static double
+current_load(void)
+{
+	static time_t next;
+	static double load;
+	struct timespec now;
+	FILE *fp;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec >= next) {
+		next = now.tv_sec + 1;
+		recent = 0;
+		load = 0;
+		fp = fopen(cpu_pressure ? "/proc/pressure/cpu" : "/proc/loadavg",
+					"r");
+		if (fp) {
+			if (fscanf(fp, cpu_pressure ? "some avg10=%lf" : "%lf",
+						&load) != 1)
+				load = 0;
+			fclose(fp);
+		}
+	}
+	return cpu_pressure ? load : load + recent;
+}
+#endif
+
+/*
+ * Return TRUE if another command can be started while 'n' are running.
+ * A token must be obtained from the jobserver for all but the first.
+ */
+int
+job_slot(int n)
+{
+	if (n >= maxjobs)
+		return FALSE;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	overloaded = n > 0 && max_load >= 0 && current_load() >= max_load;
+	if (overloaded)
+		return FALSE;
+#endif
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+	if (js_read >= 0 && n > tokens) {
+		char c;
+
+		if (read(js_read, &c, 1) != 1)
+			return FALSE;
+		tokens++;
+	}
+#endif
+	IF_FEATURE_MAKE_EXTENSIONS(recent++;)
+	return TRUE;
+}
+
+/*
+ * Give back any tokens not needed now that 'n' commands are running.
+ */
+void
+release_slots(int n)
+{
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+	for (; tokens > 0 && tokens >= n; tokens--)
+		put_token();
+#endif
+}
+
+/*
+ * If a command line can be run without the help of the shell split
+ * it into words at blanks.  This is only possible if it contains no
+ * characters special to the shell and the first word isn't a reserved
+ * word, a builtin or a macro assignment.  Return NULL if the shell is
+ * needed, otherwise an argument list which should be freed, along with
+ * its first element.
+ */
+static char **
+split_command(const char *cmd)
+{
+	static const char *const shell_words[] = {
+		".", "alias", "bg", "break", "builtin", "case", "cd", "command",
+		"continue", "declare", "do", "done", "echo", "elif", "else",
+		"esac", "eval", "exec", "exit", "export", "false", "fc", "fg",
+		"fi", "for", "function", "getopts", "hash", "if", "jobs", "kill",
+		"let", "local", "printf", "pwd", "read", "readonly", "return",
+		"select", "set", "shift", "source", "test", "then", "time",
+		"times", "trap", "true", "type", "typeset", "ulimit", "umask",
+		"unalias", "unset", "until", "wait", "while"
+	};
+	char **argv, *s;
+	int argc;
+	size_t i, len;
+
+	if (cmd[strcspn(cmd, "\n|&;<>()$`\\\"'*?[]#~{}!^")] != '\0')
+		return NULL;
+
+	cmd += strspn(cmd, " \t");
+	len = strcspn(cmd, " \t");
+	if (len == 0 || memchr(cmd, '=', len) != NULL)
+		return NULL;
+	for (i = 0; i < sizeof(shell_words) / sizeof(shell_words[0]); i++) {
+		if (strlen(shell_words[i]) == len &&
+				strncmp(shell_words[i], cmd, len) == 0)
+			return NULL;
+	}
+
+	argc = 2;
+	for (s = (char *)cmd; *s; s++) {
+		if (isblank(*s))
+			argc++;
+	}
+	argv = xmalloc(argc * sizeof(char *));
+	s = xstrdup(cmd);
+	for (argc = 0; (s = strtok(argc ? NULL : s, " \t")); argc++)
+		argv[argc] = s;
+	argv[argc] = NULL;
+	return argv;
+}
+
+/*
+ * Ignore SIGINT and SIGQUIT while commands are running, as system(3)
+ * does.
+ */
+static void
+ignore_signals(void)
+{
+	struct sigaction sa;
+
+	if (nchild == 0) {
+		sa.sa_handler = SIG_IGN;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = 0;
+		sigaction(SIGINT, &sa, &old_int);
+		sigaction(SIGQUIT, &sa, &old_quit);
+	}
+}
+
+static void
+restore_signals(void)
+{
+	if (nchild == 0) {
+		sigaction(SIGINT, &old_int, NULL);
+		sigaction(SIGQUIT, &old_quit, NULL);
+	}
+}
+
+/*
+ * Start a process using posix_spawn(3), which avoids the cost of
+ * copying make's address space.  It gets the dispositions of SIGINT
+ * and SIGQUIT make had before ignoring them.  If 'search' is TRUE
+ * the file is looked for in PATH.  Return 0 or an error number.
+ */
+static int
+spawn(pid_t *pid, const char *file, char *const argv[],
+		const posix_spawn_file_actions_t *actions, int search)
+{
+	posix_spawnattr_t attr;
+	sigset_t sigdefault;
+	int err;
+
+	sigemptyset(&sigdefault);
+	if (old_int.sa_handler != SIG_IGN)
+		sigaddset(&sigdefault, SIGINT);
+	if (old_quit.sa_handler != SIG_IGN)
+		sigaddset(&sigdefault, SIGQUIT);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigdefault(&attr, &sigdefault);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+	if (search)
+		err = posix_spawnp(pid, file, actions, &attr, argv, environ);
+	else
+		err = posix_spawn(pid, file, actions, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	return err;
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Start a persistent shell.  Its standard input is a pipe from which
+ * it reads commands.  The original standard input is made available
+ * to commands as file descriptor 4 and their exit status is written
+ * to file descriptor 5.
+ */
+static struct shell *
+start_shell(void)
+{
+	posix_spawn_file_actions_t actions;
+	struct shell *sh;
+	char *argv[2];
+	int in[2], out[2], err, i;
+
+	if (pipe(in) < 0)
+		return NULL;
+	if (pipe(out) < 0) {
+		close(in[0]);
+		close(in[1]);
+		return NULL;
+	}
+	// Move the pipes out of the way of the descriptors set up in the
+	// shell and keep them from other processes.
+	for (i = 0; i < 2; i++) {
+		int fd = fcntl(in[i], F_DUPFD_CLOEXEC, 10);
+		close(in[i]);
+		in[i] = fd;
+		fd = fcntl(out[i], F_DUPFD_CLOEXEC, 10);
+		close(out[i]);
+		out[i] = fd;
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	// Standard input is closed if a makefile was read from it
+	if (fcntl(0, F_GETFD) < 0)
+		posix_spawn_file_actions_addopen(&actions, 4, "/dev/null",
+											O_RDONLY, 0);
+	else
+		posix_spawn_file_actions_adddup2(&actions, 0, 4);
+	posix_spawn_file_actions_adddup2(&actions, in[0], 0);
+	posix_spawn_file_actions_adddup2(&actions, out[1], 5);
+	argv[0] = (char *)"sh";
+	argv[1] = NULL;
+	sh = xmalloc(sizeof(struct shell));
+	err = spawn(&sh->sh_pid, shell, argv, &actions, FALSE);
+	posix_spawn_file_actions_destroy(&actions);
+	close(in[0]);
+	close(out[1]);
+
+	if (err) {
+		close(in[1]);
+		close(out[0]);
+		free(sh);
+		return NULL;
+	}
+	sh->sh_in = in[1];
+	sh->sh_out = out[0];
+	sh->sh_busy = FALSE;
+	sh->sh_next = shells;
+	shells = sh;
+	return sh;
+}
+
+/*
+ * Forget about a persistent shell which has exited.
+ */
+static void
+remove_shell(struct shell *sh)
+{
+	struct shell **shp;
+
+	for (shp = &shells; *shp != sh; shp = &(*shp)->sh_next)
+		;
+	*shp = sh->sh_next;
+	close(sh->sh_in);
+	if (sh->sh_out >= 0)
+		close(sh->sh_out);
+	free(sh);
+}
+
+/*
+ * Pass a command to an idle persistent shell.  The command is quoted
+ * and run by 'eval' in a subshell so a syntax error or a change to the
+ * shell's state doesn't affect later commands.  Return the process ID
+ * of the shell or -1 if a shell couldn't be used.
+ */
+static pid_t
+shell_command(const char *cmd, int errexit)
+{
+	struct sigaction sa, old_pipe;
+	struct shell *sh;
+	char *line, *s;
+	const char *t;
+	size_t len, done;
+	ssize_t n;
+	int try;
+
+	line = s = xmalloc(4 * strlen(cmd) + 64);
+	s = stpcpy(s, errexit ? "(set -e; eval '" : "(eval '");
+	for (t = cmd; *t; t++) {
+		if (*t == '\'')
+			s = stpcpy(s, "'\\''");
+		else
+			*s++ = *t;
+	}
+	strcpy(s, "') <&4 4<&- 5>&-; echo $? >&5\n");
+	len = strlen(line);
+
+	// A shell may have died while idle:  writing to it mustn't kill
+	// make.  Try once more with a new shell.
+	sa.sa_handler = SIG_IGN;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(SIGPIPE, &sa, &old_pipe);
+	for (try = 0; try < 2; try++) {
+		for (sh = shells; sh && (sh->sh_busy || sh->sh_out < 0);
+				sh = sh->sh_next)
+			;
+		if (!sh && !(sh = start_shell()))
+			break;
+		for (done = 0; done < len; done += n) {
+			n = write(sh->sh_in, line + done, len - done);
+			if (n < 0 && errno == EINTR)
+				n = 0;
+			else if (n < 0)
+				break;
+		}
+		if (done == len)
+			break;
+		// The shell will be forgotten when it's reaped
+		close(sh->sh_out);
+		sh->sh_out = -1;
+		sh = NULL;
+	}
+	sigaction(SIGPIPE, &old_pipe, NULL);
+	free(line);
+
+	if (!sh)
+		return -1;
+	sh->sh_busy = TRUE;
+	return sh->sh_pid;
+}
+
+/*
+ * Read the exit status of a command from a persistent shell and
+ * convert it to the form returned by waitpid(2).  The shell reports a
+ * command killed by a signal with a status which can't be told from
+ * an exit status, so it's treated as one.  Return FALSE if the shell
+ * has gone away.
+ */
+static int
+shell_status(struct shell *sh, int *status)
+{
+	char buf[16];
+	ssize_t n;
+	int code;
+
+	do {
+		n = read(sh->sh_out, buf, sizeof(buf) - 1);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0) {
+		// Wait for the shell to be reaped
+		close(sh->sh_out);
+		sh->sh_out = -1;
+		return FALSE;
+	}
+	buf[n] = '\0';
+	code = atoi(buf);
+	// Some shells report signals as 256 plus the signal number
+	*status = (code > 255 ? 255 : code) << 8;
+	sh->sh_busy = FALSE;
+	return TRUE;
+}
+#endif
+
+/*
+ * A child process has exited.  If it's a persistent shell which was
+ * running a command (because it was sent a signal, for example) its
+ * status is reported as that of the command.  Return TRUE if it was
+ * an idle persistent shell, which is just forgotten.
+ */
+static int
+forget_shell(pid_t pid, int *status)
+{
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	struct shell *sh;
+	int busy;
+
+	for (sh = shells; sh; sh = sh->sh_next) {
+		if (sh->sh_pid == pid) {
+			busy = sh->sh_busy;
+			if (busy && sh->sh_out >= 0)
+				shell_status(sh, status);
+			remove_shell(sh);
+			return !busy;
+		}
+	}
+#endif
+	return FALSE;
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Get a temporary file to collect output.  It's unlinked at once so
+ * nothing is left behind.  Return -1 if one can't be created.
+ */
+static int
+output_file(void)
+{
+	const char *tmpdir;
+	char *name;
+	int fd, fd2;
+
+	if (nspare)
+		return spare_output[--nspare];
+
+	tmpdir = getenv("TMPDIR");
+	name = xconcat3(tmpdir && *tmpdir ? tmpdir : "/tmp", "/pdpmakeXXXXXX", "");
+	fd = mkstemp(name);
+	if (fd >= 0) {
+		unlink(name);
+		// Keep it out of the way of descriptors used by commands
+		fd2 = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+		close(fd);
+		fd = fd2;
+	}
+	free(name);
+	return fd;
+}
+
+/*
+ * Arrange for the output of a job's commands to be collected.  If
+ * standard output and error are different files they're collected
+ * separately, otherwise they share a file so their order is kept.
+ * The descriptors are set to -1 if output can't be collected.
+ */
+void
+open_output(int output[2])
+{
+	output[0] = output_file();
+	output[1] = same_output || output[0] < 0 ? output[0] : output_file();
+}
+
+/*
+ * Copy collected output to one of make's own descriptors and empty
+ * the file.
+ */
+static void
+copy_output(int fd, int to)
+{
+	char buf[BUFSIZ];
+	ssize_t n, m;
+	off_t len;
+
+	if ((len = lseek(fd, 0, SEEK_CUR)) <= 0)
+		return;
+	lseek(fd, 0, SEEK_SET);
+	while (len > 0 && (n = read(fd, buf, sizeof(buf))) > 0) {
+		len -= n;
+		for (char *s = buf; n > 0; s += m, n -= m) {
+			if ((m = write(to, s, n)) < 0) {
+				if (errno != EINTR)
+					goto done;
+				m = 0;
+			}
+		}
+	}
+ done:
+	if (ftruncate(fd, 0) == 0)
+		lseek(fd, 0, SEEK_SET);
+}
+
+/*
+ * Emit the output collected for a job.  Standard output is locked so
+ * the output isn't mixed with that of other instances of make.
+ */
+void
+flush_output(const int output[2])
+{
+	struct flock fl;
+	int locked;
+
+	if (output[0] < 0)
+		return;
+	fflush(stdout);
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	while ((locked = fcntl(1, F_SETLKW, &fl)) < 0 && errno == EINTR)
+		;
+	copy_output(output[0], 1);
+	if (output[1] >= 0 && output[1] != output[0])
+		copy_output(output[1], 2);
+	if (locked == 0) {
+		fl.l_type = F_UNLCK;
+		fcntl(1, F_SETLK, &fl);
+	}
+}
+
+/*
+ * Emit the output collected for a job and keep its files for reuse.
+ */
+void
+close_output(int output[2])
+{
+	if (output[0] < 0)
+		return;
+	flush_output(output);
+	spare_output = xrealloc(spare_output, (nspare + 2) * sizeof(int));
+	spare_output[nspare++] = output[0];
+	if (output[1] >= 0 && output[1] != output[0])
+		spare_output[nspare++] = output[1];
+	output[0] = output[1] = -1;
+}
+#endif
+
+/*
+ * Start a command in the background.  Simple commands are executed
+ * directly, others are passed to the shell.  If 'errexit' is TRUE the
+ * shell is told to exit on error.  As with system(3), SIGINT and
+ * SIGQUIT are ignored by make while commands are running.  Return the
+ * process ID or -1 if the shell couldn't be started.
+ *
+ * If 'output' isn't NULL the command's standard output and error are
+ * redirected to the descriptors it contains, if they're valid.
+ *
+ * With .PERSISTENT_SHELL commands which need the shell are passed to a
+ * persistent shell, unless they invoke make, are building an include
+ * file or have their output redirected.
+ */
+pid_t
+start_command(const char *cmd, int errexit, const int *output)
+{
+	posix_spawn_file_actions_t file_actions, *actions = NULL;
+	char *argv[4], **cargv;
+	pid_t pid;
+	int err = -1;
+
+	if (output && output[0] >= 0) {
+		actions = &file_actions;
+		posix_spawn_file_actions_init(actions);
+		posix_spawn_file_actions_adddup2(actions, output[0], 1);
+		if (output[1] >= 0)
+			posix_spawn_file_actions_adddup2(actions, output[1], 2);
+	}
+
+	ignore_signals();
+	if ((cargv = split_command(cmd))) {
+		err = spawn(&pid, cargv[0], cargv, actions, TRUE);
+		free(cargv[0]);
+		free(cargv);
+	}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if (err && persist && !domake && !doinclude && !actions &&
+			(pid = shell_command(cmd, errexit)) > 0)
+		err = 0;
+#endif
+
+	// If the command couldn't be executed directly the shell will
+	// report why.
+	if (err) {
+		argv[0] = (char *)"sh";
+		argv[1] = (char *)"-c";
+		argv[2] = errexit ? xconcat3("set -e;", cmd, "") : (char *)cmd;
+		argv[3] = NULL;
+		err = spawn(&pid, shell, argv, actions, FALSE);
+		if (argv[2] != cmd)
+			free(argv[2]);
+	}
+	if (actions)
+		posix_spawn_file_actions_destroy(actions);
+
+	if (err) {
+		restore_signals();
+		errno = err;
+		return -1;
+	}
+	nchild++;
+	return pid;
+}
+
+/*
+ * Run a command and wait for it to finish.  Return its exit status
+ * or -1 if it couldn't be run.
+ */
+int
+execute_command(const char *cmd, int errexit)
+{
+	int status;
+
+	if (start_command(cmd, errexit, NULL) < 0)
+		return -1;
+	wait_command(&status, FALSE);
+	return status;
+}
+
+/*
+ * Wait for a child process to exit, a persistent shell to report the
+ * exit status of a command or, if 'token' is TRUE, a token to become
+ * available from the jobserver.  If 'token' is TRUE but commands are
+ * being held back by the load only wait a second before it's checked
+ * again.  Return the process ID, or 0 for a token or timeout.
+ */
+static pid_t
+wait_event(int *status, int token)
+{
+	sigset_t set, oldset;
+	fd_set readfds;
+	pid_t pid;
+	int maxfd, n;
+	struct timespec *timeout = NULL;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	struct timespec interval = {1, 0};
+	struct shell *sh;
+
+	if (token && overloaded) {
+		timeout = &interval;
+		token = FALSE;
+	}
+#endif
+
+	// Block SIGCHLD so it can't arrive between the calls to
+	// waitpid(2) and pselect(2).
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, &oldset);
+	for (;;) {
+		pid = waitpid(-1, status, WNOHANG);
+		if (pid > 0 && forget_shell(pid, status))
+			continue;
+		if (pid != 0)
+			break;
+		FD_ZERO(&readfds);
+		maxfd = -1;
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+		if (token && js_read >= 0) {
+			FD_SET(js_read, &readfds);
+			maxfd = js_read;
+		}
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		for (sh = shells; sh; sh = sh->sh_next) {
+			if (sh->sh_busy && sh->sh_out >= 0) {
+				FD_SET(sh->sh_out, &readfds);
+				if (sh->sh_out > maxfd)
+					maxfd = sh->sh_out;
+			}
+		}
+#endif
+		n = pselect(maxfd + 1, &readfds, NULL, NULL, timeout, &oldset);
+		if (n == 0)
+			break;		// Time to check the load
+		if (n < 0)
+			continue;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		for (sh = shells; sh; sh = sh->sh_next) {
+			if (sh->sh_busy && sh->sh_out >= 0 &&
+					FD_ISSET(sh->sh_out, &readfds) &&
+					shell_status(sh, status)) {
+				pid = sh->sh_pid;
+				goto done;
+			}
+		}
+#endif
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+		if (token && js_read >= 0 && FD_ISSET(js_read, &readfds))
+			break;
+#endif
+	}
+ IF_FEATURE_MAKE_EXTENSIONS(done:)
+	sigprocmask(SIG_SETMASK, &oldset, NULL);
+	return pid;
+}
+
+/*
+ * Wait for a command running in the background to finish.  Return
+ * its process ID and exit status.  If 'token' is TRUE also return,
+ * with a process ID of 0, if a token becomes available from the
+ * jobserver.
+ */
+pid_t
+wait_command(int *status, int token)
+{
+	pid_t pid;
+	int busy = FALSE;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	struct shell *sh;
+
+	for (sh = shells; sh; sh = sh->sh_next)
+		busy |= sh->sh_busy;
+#endif
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+	busy |= token && js_read >= 0;
+#endif
+	IF_FEATURE_MAKE_EXTENSIONS(busy |= token && overloaded;)
+
+	if (busy) {
+		if ((pid = wait_event(status, token)) == 0)
+			return 0;
+	} else {
+		do {
+			pid = waitpid(-1, status, 0);
+		} while ((pid < 0 && errno == EINTR) ||
+					(pid > 0 && forget_shell(pid, status)));
+	}
+	if (pid < 0)
+		error("wait failed: %s", strerror(errno));
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	// The resources used by a child are added to those reported for
+	// RUSAGE_CHILDREN when it's waited for.
+	if (history_file) {
+		static unsigned long utime, stime;
+		struct rusage ru;
+
+		getrusage(RUSAGE_CHILDREN, &ru);
+		last_utime = ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000;
+		last_stime = ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000;
+		last_utime -= utime;
+		last_stime -= stime;
+		utime += last_utime;
+		stime += last_stime;
+	}
+#endif
+	--nchild;
+	restore_signals();
+	files_changed();
+	return pid;
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Return the CPU time used by the command most recently waited for.
+ * Commands run by a persistent shell aren't included.
+ */
+void
+command_usage(unsigned long *utime, unsigned long *stime)
+{
+	*utime = last_utime;
+	*stime = last_stime;
+	last_utime = last_stime = 0;
+}
+#endif
@@ -3,19 +3,75 @@
  */
 #include "make.h"
 
-struct macro *macrohead[HTABSIZE];
+struct macro **macrohead;
+unsigned int macrosize;
+unsigned int macrocount;
 
-struct macro *
-getmp(const char *name)
+static struct macro *
+lookup_macro(const char *name, unsigned int hash)
 {
 	struct macro *mp;
 
-	for (mp = macrohead[getbucket(name)]; mp; mp = mp->m_next)
-		if (strcmp(name, mp->m_name) == 0)
+	if (macrosize == 0)
+		return NULL;
+
+	for (mp = macrohead[hash & (macrosize - 1)]; mp; mp = mp->m_next)
+		if (mp->m_hash == hash && strcmp(name, mp->m_name) == 0)
 			return mp;
 	return NULL;
 }
 
+struct macro *
+findmacro(const char *name)
+{
+	return lookup_macro(name, strhash(name));
+}
+
+/*
+ * Change the number of buckets in the table of macros to 'size', a
+ * power of 2.  Macros which end up in the same bucket keep their order.
+ */
+void
+resize_macros(unsigned int size)
+{
+	struct macro **head, ***tail, *mp, *next;
+	unsigned int i;
+
+	head = xmalloc(size * sizeof(struct macro *));
+	tail = xmalloc(size * sizeof(struct macro **));
+	for (i = 0; i < size; i++) {
+		head[i] = NULL;
+		tail[i] = &head[i];
+	}
+	for (i = 0; i < macrosize; i++) {
+		for (mp = macrohead[i]; mp; mp = next) {
+			next = mp->m_next;
+			mp->m_next = NULL;
+			*tail[mp->m_hash & (size - 1)] = mp;
+			tail[mp->m_hash & (size - 1)] = &mp->m_next;
+		}
+	}
+	free(tail);
+	free(macrohead);
+	macrohead = head;
+	macrosize = size;
+}
+
+struct macro *
+getmp(const char *name)
+{
+	struct macro *mp;
+
+	// The lists of prerequisites are only made when they're used
+	if ((name[0] == '?' || name[0] == '^' || name[0] == '+') && name[1] == '\0')
+		prereq_macros();
+
+	mp = findmacro(name);
+	// The result of reading an include file depends on its macros
+	IF_FEATURE_MAKE_EXTENSIONS(macro_used(name, mp);)
+	return mp;
+}
+
 static int
 is_valid_macro(const char *name)
 {
@@ -71,6 +127,7 @@ void
 setmacro(const char *name, const char *val, int level)
 {
 	struct macro *mp;
+	unsigned int hash = strhash(name);
 	bool valid = level & M_VALID;
 	bool from_env = level & M_ENVIRON;
 #if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
@@ -78,7 +135,7 @@ setmacro(const char *name, const char *val, int level)
 #endif
 
 	level &= ~(M_IMMEDIATE | M_VALID | M_ENVIRON);
-	mp = getmp(name);
+	mp = lookup_macro(name, hash);
 	if (mp) {
 		// Don't replace existing macro from a lower level
 		if (level > mp->m_level)
@@ -103,12 +160,17 @@ setmacro(const char *name, const char *val, int level)
 #endif
 		}
 
-		bucket = getbucket(name);
-		mp = xmalloc(sizeof(struct macro));
+		// Grow the table if it's full
+		if (macrocount >= macrosize)
+			resize_macros(macrosize ? 2 * macrosize : 256);
+		bucket = hash & (macrosize - 1);
+		mp = arena_alloc(sizeof(struct macro));
 		mp->m_next = macrohead[bucket];
 		macrohead[bucket] = mp;
+		macrocount++;
 		mp->m_flag = FALSE;
-		mp->m_name = xstrdup(name);
+		mp->m_name = arena_strdup(name);
+		mp->m_hash = hash;
 	}
 #if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
 	mp->m_immediate = immediate;
@@ -121,16 +183,14 @@ setmacro(const char *name, const char *val, int level)
 void
 freemacros(void)
 {
-	int i;
-	struct macro *mp, *nextmp;
+	unsigned int i;
+	struct macro *mp;
 
-	for (i = 0; i < HTABSIZE; i++) {
-		for (mp = macrohead[i]; mp; mp = nextmp) {
-			nextmp = mp->m_next;
-			free(mp->m_name);
+	// Macros are freed with the arena but their values aren't
+	for (i = 0; i < macrosize; i++) {
+		for (mp = macrohead[i]; mp; mp = mp->m_next)
 			free(mp->m_val);
-			free(mp);
-		}
 	}
+	free(macrohead);
 }
 #endif
@@ -1,11 +1,12 @@
 /*
- * make [--posix] [-C path] [-f makefile] [-j num] [-x pragma]
+ * make [--posix] [-C path] [-f makefile] [-j num] [-l load] [-x pragma]
  *      [-ehiknpqrsSt] [macro[:[:[:]]]=val ...] [target ...]
  *
  *  --posix  Enforce POSIX mode (non-POSIX)
  *  -C  Change directory to path (non-POSIX)
  *  -f  Makefile name
- *  -j  Number of jobs to run in parallel (not implemented)
+ *  -j  Number of jobs to run in parallel
+ *  -l  Don't start jobs while the load is above this (non-POSIX)
  *  -x  Pragma to make POSIX mode less strict (non-POSIX)
  *  -e  Environment variables override macros in makefiles
  *  -h  Display help information (non-POSIX)
@@ -26,10 +27,12 @@ const char *myname;
 const char *makefile;
 struct file *makefiles;
 struct cmd *curr_cmd;
+char *shell;
 #if ENABLE_FEATURE_MAKE_POSIX_2024
 char *numjobs = NULL;
 #endif
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
+char *maxload = NULL;
 bool posix;
 bool seen_first;
 unsigned char pragma = 0;
@@ -47,7 +50,7 @@ usage(int exit_code)
 		IF_FEATURE_MAKE_EXTENSIONS(" [--posix] [-C path]")
 		" [-f makefile]"
 		IF_FEATURE_MAKE_POSIX_2024(" [-j num]")
-		IF_FEATURE_MAKE_EXTENSIONS(" [-x pragma]")
+		IF_FEATURE_MAKE_EXTENSIONS(" [-l load] [-x pragma]")
 		IF_FEATURE_MAKE_EXTENSIONS("\n\t")
 		IF_NOT_FEATURE_MAKE_EXTENSIONS(" [-eiknpqrsSt] ")
 		IF_FEATURE_MAKE_EXTENSIONS(" [-ehiknpqrsSt] ")
@@ -154,6 +157,24 @@ process_options(int argc, char **argv, int from_env)
 			flags |= OPT_k;
 			flags &= ~OPT_S;
 			break;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		case 'l':	// Load limit, optionally a percentage of CPU pressure
+			if (!posix) {
+				char *end;
+				double load = strtod(optarg, &end);
+
+				if (end != optarg && *end == '%')
+					end++;
+				if (end == optarg || *end != '\0' || !(load >= 0))
+					usage(2);
+				free(maxload);
+				maxload = xstrdup(optarg);
+				flags |= OPT_l;
+				break;
+			}
+			error("-l not allowed");
+			break;
+#endif
 		case 'n':	// Pretend mode
 			flags |= OPT_n;
 			break;
@@ -223,11 +244,19 @@ expand_makeflags(int *fargc)
 	// a macro definition and only contains valid option characters,
 	// add a hyphen.
 	argc = 3;
-	if (makeflags[0] != '-' && strchr(makeflags, '=') == NULL) {
-		if (strspn(makeflags, OPTSTR1 + 1) != strlen(makeflags))
-			error("invalid MAKEFLAGS");
+	if (makeflags[0] != '-' && strchr(makeflags, '=') == NULL &&
+			strspn(makeflags, OPTSTR1 + 1) == strlen(makeflags)) {
 		*p++ = '-';
 	} else {
+		// GNU make puts single letter options in the first word
+		// without a hyphen.
+		if (makeflags[0] != '-') {
+			if (strspn(makeflags, OPTSTR1 + 1) ==
+					strcspn(makeflags, " \t"))
+				*p++ = '-';
+			else if (strchr(makeflags, '=') == NULL)
+				error("invalid MAKEFLAGS");
+		}
 		// MAKEFLAGS may need to be split, estimate size of argv array.
 		for (m = makeflags; *m; ++m) {
 			if (isblank(*m))
@@ -243,6 +272,26 @@ expand_makeflags(int *fargc)
 	// Copy MAKEFLAGS into argstr, splitting at non-escaped blanks.
 	m = makeflags;
 	do {
+		// Long options from other implementations aren't copied.
+		// Jobserver details are saved for init_jobs().
+		if (p == argv[argc - 1] && m[0] == '-' && m[1] == '-' &&
+				m[2] != '\0' && !isblank(m[2])) {
+			size_t len = strcspn(m, " \t");
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+			if (strncmp(m, "--jobserver-auth=", 17) == 0 ||
+					strncmp(m, "--jobserver-fds=", 16) == 0) {
+				const char *s = strchr(m, '=') + 1;
+
+				free(jobserver_auth);
+				jobserver_auth = xstrndup(s, len - (s - m));
+			}
+#endif
+			for (m += len; isblank(*m); m++)
+				;
+			if (*m == '\0' && argc > 2)
+				argc--;
+			continue;
+		}
 		if (*m == '\\' && m[1] != '\0')
 			m++;	// Skip backslash, copy next character unconditionally.
 		else if (isblank(*m)) {
@@ -379,7 +428,7 @@ update_makeflags(void)
 
 	t = OPTSTR1 + 1;
 	for (i = 0; *t; t++) {
-#if ENABLE_FEATURE_MAKE_POSIX_2024
+#if ENABLE_FEATURE_MAKE_POSIX_2024 || ENABLE_FEATURE_MAKE_EXTENSIONS
 		if (*t == ':')
 			continue;
 #endif
@@ -390,12 +439,17 @@ update_makeflags(void)
 			if (*t == 'j') {
 				makeflags = xappendword(makeflags, numjobs);
 			}
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			if (*t == 'l') {
+				makeflags = xappendword(makeflags, maxload);
+			}
 #endif
 		}
 		i++;
 	}
 
-	for (i = 0; i < HTABSIZE; ++i) {
+	for (i = 0; i < (int)macrosize; ++i) {
 		for (mp = macrohead[i]; mp; mp = mp->m_next) {
 			if ((mp->m_level == 1 || mp->m_level == 2) &&
 					strcmp(mp->m_name, "MAKEFLAGS") != 0) {
@@ -507,6 +561,57 @@ get_shell(void)
 	return xstrdup("/bin/sh");
 }
 
+/*
+ * Open a makefile, noting it in case the result of reading the
+ * makefiles is cached.
+ */
+static FILE *
+open_makefile(const char *name)
+{
+	IF_FEATURE_MAKE_EXTENSIONS(cache_makefile(name);)
+	return fopen(name, "r");
+}
+
+static void
+read_makefiles(void)
+{
+	FILE *ifd;
+	struct file *fp;
+
+	fp = makefiles;
+	if (!fp) {	// Look for a default Makefile
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		if (!posix && (ifd = open_makefile("PDPmakefile")) != NULL)
+			makefile = "PDPmakefile";
+		else
+#endif
+		if ((ifd = open_makefile("makefile")) != NULL)
+			makefile = "makefile";
+		else if ((ifd = open_makefile("Makefile")) != NULL)
+			makefile = "Makefile";
+		else
+			error("no makefile found");
+		goto read_makefile;
+	}
+
+	while (fp) {
+		if (strcmp(fp->f_name, "-") == 0) {	// Can use stdin as makefile
+			ifd = stdin;
+			IF_FEATURE_MAKE_EXTENSIONS(disable_cache();)
+			makefile = "stdin";
+		} else {
+			if ((ifd = open_makefile(fp->f_name)) == NULL)
+				error("can't open %s: %s", fp->f_name, strerror(errno));
+			makefile = fp->f_name;
+		}
+		fp = fp->f_next;
+ read_makefile:
+		input(ifd, 0);
+		fclose(ifd);
+		makefile = NULL;
+	}
+}
+
 int
 main(int argc, char **argv)
 {
@@ -515,11 +620,9 @@ main(int argc, char **argv)
 #else
 	const char *path = "make";
 #endif
-	char **fargv, **fargv0, *shell;
+	char **fargv, **fargv0;
 	int fargc, estat;
 	bool found_target;
-	FILE *ifd;
-	struct file *fp;
 
 	if (argc == 0) {
 		return EXIT_FAILURE;
@@ -600,9 +703,9 @@ main(int argc, char **argv)
 	// Read built-in rules
 	input(NULL, 0);
 
+	// Commands are run by this shell, not the one in $(SHELL)
 	shell = get_shell();
 	setmacro("SHELL", shell, 4);
-	free((void *)shell);
 	setmacro("MAKE", path, 4);
 #if ENABLE_FEATURE_MAKE_POSIX_2024
 	if (!POSIX_2017) {
@@ -628,41 +731,24 @@ main(int argc, char **argv)
 	free((void *)newpath);
 #endif
 
-	fp = makefiles;
-	if (!fp) {	// Look for a default Makefile
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-		if (!posix && (ifd = fopen("PDPmakefile", "r")) != NULL)
-			makefile = "PDPmakefile";
-		else
-#endif
-		if ((ifd = fopen("makefile", "r")) != NULL)
-			makefile = "makefile";
-		else if ((ifd = fopen("Makefile", "r")) != NULL)
-			makefile = "Makefile";
-		else
-			error("no makefile found");
-		goto read_makefile;
-	}
-
-	while (fp) {
-		if (strcmp(fp->f_name, "-") == 0) {	// Can use stdin as makefile
-			ifd = stdin;
-			makefile = "stdin";
-		} else {
-			if ((ifd = fopen(fp->f_name, "r")) == NULL)
-				error("can't open %s: %s", fp->f_name, strerror(errno));
-			makefile = fp->f_name;
-		}
-		fp = fp->f_next;
- read_makefile:
-		input(ifd, 0);
-		fclose(ifd);
-		makefile = NULL;
+	if (!load_cache()) {
+		read_makefiles();
+		save_cache();
 	}
+#else
+	read_makefiles();
+#endif
 
 	if (print)
 		print_details();
 
+	init_jobs();
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if (!posix)
+		read_history();
+#endif
+
 	mark_special(".SILENT", OPT_s, N_SILENT);
 	mark_special(".IGNORE", OPT_i, N_IGNORE);
 	mark_special(".PRECIOUS", OPT_precious, N_PRECIOUS);
@@ -670,6 +756,14 @@ main(int argc, char **argv)
 	if (!POSIX_2017)
 		mark_special(".PHONY", OPT_phony, N_PHONY);
 #endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if (!posix) {
+		mark_special(".ONESHELL", OPT_oneshell, N_ONESHELL);
+		mark_special(".OUTPUT_SYNC", OPT_syncout, N_SYNCOUT);
+		mark_special(".OUTPUT_SYNC_LINE", OPT_syncline, N_SYNCLINE);
+		mark_special(".BATCH_ARCHIVES", OPT_batch, N_BATCH);
+	}
+#endif
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 	if (posix)
@@ -685,6 +779,10 @@ main(int argc, char **argv)
 		}
 	}
 
+#if ENABLE_FEATURE_MAKE_PREFETCH
+	prefetch_modtimes(argv);
+#endif
+
 	estat = 0;
 	found_target = FALSE;
 	for (; *argv; argv++) {
@@ -706,9 +804,21 @@ main(int argc, char **argv)
 # if ENABLE_FEATURE_MAKE_POSIX_2024
 	free((void *)numjobs);
 # endif
+# if ENABLE_FEATURE_MAKE_EXTENSIONS
+	free(maxload);
+# endif
+	free(shell);
+	IF_FEATURE_MAKE_EXTENSIONS(free_history();)
+	IF_FEATURE_MAKE_EXTENSIONS(free_cache();)
+# if ENABLE_FEATURE_MAKE_DIRCACHE
+	free_dirs();
+# endif
+	free_archives();
 	freenames();
 	freemacros();
 	freefiles(makefiles);
+	free_strings();
+	free_arena();
 #endif
 
 	return estat & MAKE_FAILURE;
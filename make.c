@@ -5,16 +5,313 @@
 
 struct name *target;
 
-void
-remove_target(void)
+// A job holds the state of a target while it's being made.  In a
+// parallel build the job may have to wait for prerequisites to be
+// made or for commands running in the background to finish.
+struct job {
+	struct job *j_next;			// Next in list of running jobs
+	struct name *j_name;		// Target being made
+	struct depend *j_waiting;	// Targets waiting for this one to be made
+	struct rule *j_rule;		// Rule whose prerequisites are being made
+	struct depend *j_dep;		// Next prerequisite to be made
+	int j_pending;				// Number of prerequisites not yet made
+	int j_estat;				// Status of target
+	int j_level;				// Recursion level
+	unsigned long j_chain;		// Time to make target and those needing it
+	unsigned long j_seq;		// Order in which job became ready to run
+	int j_index;				// Position in run queue, or -1
+	struct name *j_impdep;		// Implicit prerequisite
+	struct rule j_infrule;		// Inference rule
+	struct cmd *j_sccmd;		// Commands for single-colon rule
+	struct name *j_implicit;	// Implicit prerequisite of current rule
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	const char *j_tsuff;		// Suffix of target
+#endif
+	struct timespec j_dtim;		// Time of most recent prerequisite
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	struct name *j_first;		// First out-of-date prerequisite
+#endif
+	bool j_lists;				// Lists of prerequisites have been made
+	struct words j_oodate;		// Out-of-date prerequisites ($?)
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+	struct words j_allsrc;		// All prerequisites ($+)
+	struct words j_dedup;		// Deduplicated prerequisites ($^)
+#endif
+	struct cmd *j_cmd;			// Command line being run
+	char *j_command;			// Expanded command line
+	char *j_q;					// Command line without prefixes
+	bool j_signore;				// Ignore errors from command line
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	int j_output[2];			// Files collecting output, or -1
+	struct timespec j_start;	// Time commands started, if being recorded
+	unsigned long j_utime;		// CPU time used by commands
+	unsigned long j_stime;
+	int j_xstat;				// Exit status of failed command
+	struct batch *j_batch;		// Batch of archive members, if being made
+	struct cmd *j_arcmd;		// Commands to add batch to archive
+	struct job *j_members;		// Rest of batch being added with this one
+#endif
+	int j_cstat;				// Status of commands
+	pid_t j_pid;				// Process running command line
+};
+
+// Jobs ready to run commands are kept in a heap so those on the longest
+// chain of targets still to be made, by the times recorded in the
+// history, are started first.  Otherwise jobs are started in the order
+// they became ready.
+static struct job **runq;
+static int nrunq, maxrunq;
+static unsigned long nready;
+static struct job *running;				// Jobs with commands running
+static int nrunning;
+static struct job *held;				// Jobs waiting for an archive
+static struct job **held_end = &held;
+static struct job *macro_job;			// Job the internal macros are for
+static bool macro_lists;				// $?, $^ and $+ are for macro_job
+static struct name *goal;				// Target being made by make()
+static int goal_estat;
+
+static int make0(struct name *np, int level, unsigned long chain);
+static int progress(struct job *jp);
+static void end_cmds(struct job *jp);
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+// With .BATCH_ARCHIVES the members of an archive that would be made
+// by an inference rule such as .c.a are instead made as files by the
+// corresponding rule, such as .c.o, possibly in parallel.  Those made
+// at the same time are then added to the archive by a single command.
+struct batch {
+	struct batch *b_next;	// Next in list of batches
+	char *b_archive;		// Name of archive
+	int b_pending;			// Members whose commands are being run
+	struct job *b_done;		// Members waiting to be added to archive
+};
+
+static struct batch *batches;
+#endif
+
+/*
+ * Return TRUE if job 'a' should be run before job 'b'.
+ */
+static int
+before(const struct job *a, const struct job *b)
+{
+	if (a->j_chain != b->j_chain)
+		return a->j_chain > b->j_chain;
+	return a->j_seq < b->j_seq;
+}
+
+/*
+ * Move a job in the run queue from position 'i' towards the front
+ * until it's in order.
+ */
+static void
+sift_up(struct job *jp, int i)
+{
+	int parent;
+
+	for (; i > 0 && before(jp, runq[parent = (i - 1) / 2]); i = parent) {
+		runq[i] = runq[parent];
+		runq[i]->j_index = i;
+	}
+	runq[i] = jp;
+	jp->j_index = i;
+}
+
+/*
+ * Add a job to the run queue.
+ */
+static void
+enqueue(struct job *jp)
+{
+	if (nrunq == maxrunq) {
+		maxrunq = maxrunq ? 2 * maxrunq : 64;
+		runq = xrealloc(runq, maxrunq * sizeof(struct job *));
+	}
+	jp->j_seq = nready++;
+	sift_up(jp, nrunq++);
+}
+
+/*
+ * Remove the job that should be run first from the run queue.
+ */
+static struct job *
+dequeue(void)
+{
+	struct job *top = runq[0], *jp = runq[--nrunq];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < nrunq) {
+		if (child + 1 < nrunq && before(runq[child + 1], runq[child]))
+			child++;
+		if (!before(runq[child], jp))
+			break;
+		runq[i] = runq[child];
+		runq[i]->j_index = i;
+		i = child;
+	}
+	if (nrunq) {
+		runq[i] = jp;
+		jp->j_index = i;
+	}
+	top->j_index = -1;
+	return top;
+}
+
+/*
+ * A target already being made is also needed by a target whose chain
+ * takes the given time.  Raise the job's priority if that makes its own
+ * chain longer.  Jobs for the target's prerequisites aren't changed.
+ */
+static void
+raise_chain(struct job *jp, unsigned long chain)
+{
+	chain += IF_FEATURE_MAKE_EXTENSIONS(target_time(jp->j_name->n_name) +) 0;
+	if (chain > jp->j_chain) {
+		jp->j_chain = chain;
+		if (jp->j_index >= 0)
+			sift_up(jp, jp->j_index);
+	}
+}
+
+/*
+ * If a name is of the form 'lib.a(member.o)' return the length of the
+ * archive's name, otherwise 0.
+ */
+static size_t
+archive_len(const char *name)
+{
+	const char *s = strchr(name, '(');
+
+	return s && s != name && name[strlen(name) - 1] == ')' ? s - name : 0;
+}
+
+/*
+ * Return TRUE if the commands for a job may update an archive which
+ * the commands of a running job are already updating.  Such jobs are
+ * run one at a time.
+ */
+static int
+archive_busy(struct job *jp)
+{
+	const char *name = jp->j_name->n_name;
+	size_t len = archive_len(name);
+	struct job *rp;
+
+	if (len == 0 IF_FEATURE_MAKE_EXTENSIONS(|| jp->j_batch))
+		return FALSE;
+	for (rp = running; rp; rp = rp->j_next) {
+		if (archive_len(rp->j_name->n_name) == len &&
+				IF_FEATURE_MAKE_EXTENSIONS(!rp->j_batch &&)
+				strncmp(rp->j_name->n_name, name, len) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * If the target of a job is a member of an archive that's to be updated
+ * in batches and it's to be made by an inference rule, whose implicit
+ * prerequisite is given, return the commands of the rule which makes
+ * the member as a file.  The job is added to the batch for its archive.
+ */
+static struct cmd *
+batch_cmds(struct job *jp, struct name *impdep)
+{
+	struct name *np = jp->j_name, *ap, *rp;
+	struct cmd *cp = NULL;
+	struct batch *bp;
+	char *name, *member = NULL, *rule;
+	size_t len;
+
+	if (posix || dotouch || quest || (np->n_flag & N_DOUBLE))
+		return NULL;
+
+	name = splitlib(np->n_name, &member);
+	ap = findname(name);
+	if (!member || !(batchar || (ap && (ap->n_flag & N_BATCH))))
+		goto done;
+
+	// The implicit prerequisite is the member's basename followed by
+	// the suffix of the inference rule used.
+	len = suffix(member) - member;
+	if (strncmp(impdep->n_name, member, len) != 0)
+		goto done;
+	rule = xconcat3(impdep->n_name + len, member + len, "");
+	rp = findname(rule);
+	free(rule);
+	if (!rp || !rp->n_rule || !(cp = rp->n_rule->r_cmd))
+		goto done;
+
+	for (bp = batches; bp; bp = bp->b_next) {
+		if (strcmp(bp->b_archive, name) == 0)
+			break;
+	}
+	if (!bp) {
+		bp = xmalloc(sizeof(struct batch));
+		bp->b_next = batches;
+		bp->b_archive = xstrdup(name);
+		bp->b_pending = 0;
+		bp->b_done = NULL;
+		batches = bp;
+	}
+	jp->j_batch = bp;
+ done:
+	free(name);
+	return cp;
+}
+
+/*
+ * The commands to make a member of an archive as a file have finished,
+ * or weren't needed.
+ * If they succeeded hold the job until it can be added to the archive
+ * and return TRUE.
+ */
+static int
+batch_done(struct job *jp)
+{
+	struct batch *bp = jp->j_batch;
+
+	if (!bp)
+		return FALSE;
+	jp->j_batch = NULL;
+	bp->b_pending--;
+	if ((jp->j_cstat & MAKE_FAILURE))
+		return FALSE;
+	jp->j_next = bp->b_done;
+	bp->b_done = jp;
+	return TRUE;
+}
+#endif
+
+/*
+ * Remove a target after its commands have failed or been interrupted.
+ */
+static void
+delete_target(struct name *np)
 {
 	if (!dryrun && !print && !precious &&
-			target && !(target->n_flag & (N_PRECIOUS | N_PHONY)) &&
-			unlink(target->n_name) == 0) {
-		diagnostic("'%s' removed", target->n_name);
+			!(np->n_flag & (N_PRECIOUS | N_PHONY)) &&
+			unlink(np->n_name) == 0) {
+		diagnostic("'%s' removed", np->n_name);
 	}
 }
 
+/*
+ * Remove the targets of any commands currently being run.
+ */
+void
+remove_target(void)
+{
+	struct job *jp;
+
+	if (target)
+		delete_target(target);
+	for (jp = running; jp; jp = jp->j_next)
+		delete_target(jp->j_name);
+}
+
 /*
  * Update the modification time of a file to now.
  */
@@ -32,6 +329,7 @@ touch(struct name *np)
 				int fd = open(np->n_name, O_RDWR | O_CREAT, 0666);
 				if (fd >= 0) {
 					close(fd);
+					files_changed();
 					return;
 				}
 			}
@@ -40,280 +338,910 @@ touch(struct name *np)
 	}
 }
 
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Remove the suffix from a name, either the one provided in 'tsuff'
+ * or, if 'tsuff' is NULL, one of the known suffixes.
+ */
+static char *
+remove_suffix(const char *name, const char *tsuff)
+{
+	char *base = NULL;
+
+	if (tsuff != NULL) {
+		base = has_suffix(name, tsuff);
+	} else {
+		struct name *xp = newname(".SUFFIXES");
+		for (struct rule *rp = xp->n_rule; rp; rp = rp->r_next) {
+			for (struct depend *dp = rp->r_dep; dp; dp = dp->d_next) {
+				base = has_suffix(name, dp->d_name->n_name);
+				if (base) {
+					return base;
+				}
+			}
+		}
+	}
+	return base;
+}
+#endif
+
+/*
+ * Set the internal macros for the current rule of a job.  $?, $^ and
+ * $+ are left to prereq_macros().
+ */
+static void
+internal_macros(struct job *jp)
+{
+	struct name *np = jp->j_name;
+	struct name *implicit = jp->j_implicit;
+	char *name, *member = NULL, *base = NULL, *prereq = NULL;
+
+	name = splitlib(np->n_name, &member);
+	setmacro("%", member, 0 | M_VALID);
+	// A member of an archive being made as a file is the target
+	setmacro("@", IF_FEATURE_MAKE_EXTENSIONS(jp->j_batch ? member :) name,
+				0 | M_VALID);
+	if (implicit IF_FEATURE_MAKE_EXTENSIONS(|| !posix)) {
+		char *s;
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		// As an extension, if we're not dealing with an implicit
+		// prerequisite set $< to the first out-of-date prerequisite.
+		if (implicit == NULL) {
+			if (jp->j_first)
+				prereq = jp->j_first->n_name;
+		} else
+#endif
+			prereq = implicit->n_name;
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		if (!posix && member == NULL) {
+			// As an extension remove a suffix that doesn't necessarily
+			// start with a period from a target, but not for targets
+			// of the form lib.a(member.o).
+			base = remove_suffix(name, jp->j_tsuff);
+			if (base) {
+				free(name);
+				name = base;
+			}
+		} else
+#endif
+		{
+			base = member ? member : name;
+			s = suffix(base);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			// As an extension, if we're not dealing with an implicit
+			// prerequisite and the target ends with a known suffix,
+			// remove it and set $* to the stem, else to an empty string.
+			if (implicit == NULL && !is_suffix(s))
+				base = NULL;
+			else
+#endif
+				*s = '\0';
+		}
+	}
+	setmacro("<", prereq, 0 | M_VALID);
+	setmacro("*", base, 0 | M_VALID);
+	free(name);
+
+	macro_job = jp;
+	macro_lists = FALSE;
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * A command for the job has been waited for:  add the CPU time it used
+ * to the job's total, if the history is being kept.
+ */
+static void
+add_usage(struct job *jp)
+{
+	unsigned long utime, stime;
+
+	if (jp->j_start.tv_sec) {
+		command_usage(&utime, &stime);
+		jp->j_utime += utime;
+		jp->j_stime += stime;
+	}
+}
+
+/*
+ * Add a record of the job's commands to the history, if it's being
+ * kept and commands were run.  'status' is that of the command which
+ * failed, or 0.
+ */
+static void
+record_job(struct job *jp, int status)
+{
+	struct timespec now;
+	int code;
+
+	if (!jp->j_start.tv_sec)
+		return;
+	if (status == -1)
+		code = 127;
+	else if (WIFSIGNALED(status))
+		code = 128 + WTERMSIG(status);
+	else
+		code = WEXITSTATUS(status);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record_target(jp->j_name->n_name,
+			(now.tv_sec - jp->j_start.tv_sec) * 1000 +
+			(now.tv_nsec - jp->j_start.tv_nsec) / 1000000,
+			code, jp->j_utime, jp->j_stime,
+			IF_FEATURE_MAKE_POSIX_2024(jp->j_dedup.w_buf)
+			IF_NOT_FEATURE_MAKE_POSIX_2024(jp->j_oodate.w_buf));
+	jp->j_start.tv_sec = 0;
+	jp->j_utime = jp->j_stime = 0;
+}
+#endif
+
+/*
+ * Wait for any commands running in the background to finish.  This
+ * is used when the build is being abandoned so the only action taken
+ * is to report failures.
+ */
+static void
+wait_for_running(void)
+{
+	struct job *jp, **jpp;
+	pid_t pid;
+	int status;
+
+	while (running) {
+		pid = wait_command(&status, FALSE);
+		for (jpp = &running; (jp = *jpp); jpp = &jp->j_next) {
+			if (jp->j_pid == pid) {
+				*jpp = jp->j_next;
+				nrunning--;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+				close_output(jp->j_output);
+				add_usage(jp);
+				record_job(jp, jp->j_signore ? 0 : status);
+#endif
+				if (status != 0 && !jp->j_signore) {
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+					if (!posix && WIFSIGNALED(status))
+						delete_target(jp->j_name);
+#endif
+					curr_cmd = jp->j_cmd;
+					diagnostic("failed to build '%s'", jp->j_name->n_name);
+					curr_cmd = NULL;
+				}
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Check the exit status of a command line.  Return FALSE if the
+ * remaining commands for the target should be skipped.
+ */
+static int
+command_done(struct job *jp, int status)
+{
+	struct name *np = jp->j_name;
+
+	IF_FEATURE_MAKE_EXTENSIONS(add_usage(jp);)
+
+	// If this command was being run to create an include file
+	// or bring it up-to-date errors should be ignored and a
+	// failure status returned.
+	if (status == -1 && !doinclude) {
+		IF_FEATURE_MAKE_EXTENSIONS(flush_output(jp->j_output);)
+		error("couldn't execute '%s'", jp->j_q);
+	} else if (status != 0 && !jp->j_signore) {
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		if (!posix && WIFSIGNALED(status))
+			delete_target(np);
+		// Report the failure after the command's output
+		flush_output(jp->j_output);
+#endif
+		if (doinclude) {
+			warning("failed to build '%s'", np->n_name);
+		} else {
+			const char *err_type = NULL;
+			int err_value = 1;
+
+			if (WIFEXITED(status)) {
+				err_type = "exit";
+				err_value = WEXITSTATUS(status);
+			} else if (WIFSIGNALED(status)) {
+				err_type = "signal";
+				err_value = WTERMSIG(status);
+			}
+
+			if (!quest || err_value == 127) {
+				if (err_type)
+					diagnostic("failed to build '%s' %s %d",
+							np->n_name, err_type, err_value);
+				else
+					diagnostic("failed to build '%s'", np->n_name);
+			}
+
+			if (errcont) {
+				IF_FEATURE_MAKE_EXTENSIONS(jp->j_xstat = status;)
+				jp->j_cstat |= MAKE_FAILURE;
+				free(jp->j_command);
+				return FALSE;
+			}
+			IF_FEATURE_MAKE_EXTENSIONS(record_job(jp, status);)
+			wait_for_running();
+			exit(2);
+		}
+	}
+	jp->j_cstat = MAKE_DIDSOMETHING;
+	free(jp->j_command);
+	return TRUE;
+}
+
+/*
+ * Handle the prefixes of an expanded command line and echo it if
+ * required.  Return a pointer to the command following the prefixes.
+ */
+static char *
+command_prefix(struct job *jp, char *q, uint32_t *signore, uint32_t *sdomake)
+{
+	struct name *np = jp->j_name;
+	uint32_t ssilent;
+
+	ssilent = silent || (np->n_flag & N_SILENT) || dotouch;
+	*signore = ignore || (np->n_flag & N_IGNORE);
+	*sdomake = (!dryrun || doinclude || domake) && !dotouch;
+	for (;;) {
+		if (*q == '@')	// Specific silent
+			ssilent = TRUE + 1;
+		else if (*q == '-')	// Specific ignore
+			*signore = TRUE;
+		else if (*q == '+')	// Specific domake
+			*sdomake = TRUE + 1;
+		else
+			break;
+		do {
+			q++;
+		} while (isblank(*q));
+	}
+
+	if (*sdomake > TRUE) {
+		// '+' must not override '@' or .SILENT
+		if (ssilent != TRUE + 1 && !(np->n_flag & N_SILENT))
+			ssilent = FALSE;
+	} else if (!*sdomake)
+		ssilent = dotouch;
+
+	if (!ssilent && *q != '\0') {	// Ignore empty commands
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		// Echo the command along with its collected output
+		if (jp->j_output[0] >= 0) {
+			dprintf(jp->j_output[0], "%s\n", q);
+		} else
+#endif
+		{
+			puts(q);
+			fflush(stdout);
+		}
+	}
+	return q;
+}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+/*
+ * Join the job's command lines, from the current one on, into a
+ * script to be run by one shell.  Each line is echoed according to
+ * its own prefixes.  Errors are ignored if any line has a '-' prefix.
+ * The script is run even with -n if any line has a '+' prefix or
+ * expands $(MAKE).
+ */
+static char *
+oneshell_script(struct job *jp, uint32_t *signore, uint32_t *sdomake)
+{
+	struct cmd *cp;
+	char *q, *command, *script = NULL;
+	uint32_t lignore, ldomake;
+	IF_FEATURE_MAKE_POSIX_2024(uint32_t makes = 0;)
+
+	*signore = *sdomake = FALSE;
+	for (cp = jp->j_cmd; cp; cp = cp->c_next) {
+		curr_cmd = jp->j_cmd = cp;
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+		opts &= ~OPT_make;
+#endif
+		command = expand_macros(cp->c_cmd, FALSE);
+		q = command_prefix(jp, command, &lignore, &ldomake);
+		*signore |= lignore;
+		if (ldomake > *sdomake)
+			*sdomake = ldomake;
+		IF_FEATURE_MAKE_POSIX_2024(makes |= domake;)
+		if (*q != '\0') {
+			q = script ? xconcat3(script, "\n", q) : xstrdup(q);
+			free(script);
+			script = q;
+		}
+		free(command);
+	}
+	IF_FEATURE_MAKE_POSIX_2024(opts |= makes;)
+	return script ? script : xstrdup("");
+}
+#endif
+
+/*
+ * Do commands to make a target, starting with the job's current
+ * command line.  In a parallel build a command line that has to be
+ * executed is started in the background and FALSE is returned:
+ * resume_cmds() must be called when it finishes.  TRUE is returned
+ * when all the commands have been dealt with.
+ *
+ * For targets with the .ONESHELL attribute all the command lines are
+ * run by a single shell.
+ *
+ * In a parallel build the output of commands for targets with the
+ * .OUTPUT_SYNC or .OUTPUT_SYNC_LINE attributes is collected and
+ * emitted when all the commands, or each command line, are done.
+ * Commands which invoke make aren't affected.
+ */
+static int
+docmds(struct job *jp)
+{
+	struct name *np = jp->j_name;
+	struct cmd *cp;
+	char *q, *command;
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if (!posix && maxjobs > 1 && jp->j_output[0] < 0 && jp->j_cmd &&
+			(syncout || syncline || (np->n_flag & (N_SYNCOUT | N_SYNCLINE))))
+		open_output(jp->j_output);
+	if (history_file && !jp->j_start.tv_sec && !dryrun && !quest && !dotouch)
+		clock_gettime(CLOCK_MONOTONIC, &jp->j_start);
+#endif
+
+	for (; (cp = jp->j_cmd); jp->j_cmd = cp->c_next) {
+		uint32_t signore, sdomake;
+		int errexit;
+
+		// Location of command in makefile (for use in error messages)
+		curr_cmd = cp;
+		// Other jobs may have changed the internal macros
+		if (macro_job != jp)
+			internal_macros(jp);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+		if (!posix && (oneshell || (np->n_flag & N_ONESHELL))) {
+			q = command = oneshell_script(jp, &signore, &sdomake);
+			cp = jp->j_cmd;
+			errexit = !signore;
+		} else
+#endif
+		{
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+			opts &= ~OPT_make;	// We want to know if $(MAKE) is expanded
+#endif
+			command = expand_macros(cp->c_cmd, FALSE);
+			q = command_prefix(jp, command, &signore, &sdomake);
+			errexit = !signore IF_FEATURE_MAKE_EXTENSIONS(&& posix);
+		}
+
+		if (quest && sdomake != TRUE + 1) {
+			// MAKE_FAILURE means rebuild is needed
+			jp->j_cstat |= MAKE_FAILURE | MAKE_DIDSOMETHING;
+			free(command);
+			continue;
+		}
+
+		if (sdomake && *q != '\0') {	// Ignore empty commands
+			// Run it, using the shell if necessary
+			int status;
+
+			jp->j_command = command;
+			jp->j_q = q;
+			jp->j_signore = signore;
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+			share_jobserver(domake);
+#endif
+			if (maxjobs > 1) {
+				const int *output = NULL;
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+				// Output of recursive make is passed straight through
+				if (domake)
+					flush_output(jp->j_output);
+				else
+					output = jp->j_output;
+#endif
+				jp->j_pid = start_command(q, errexit, output);
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+				share_jobserver(FALSE);
+#endif
+				if (jp->j_pid > 0)
+					return FALSE;
+				if (!command_done(jp, -1))
+					break;
+				continue;
+			}
+
+			target = np;
+			status = execute_command(q, errexit);
+			target = NULL;
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+			share_jobserver(FALSE);
+#endif
+			if (!command_done(jp, status))
+				break;
+			continue;
+		}
+		if (sdomake || dryrun)
+			jp->j_cstat = MAKE_DIDSOMETHING;
+		free(command);
+	}
+
+	if (dotouch && !(np->n_flag & N_PHONY) &&
+			!(jp->j_cstat & MAKE_DIDSOMETHING)) {
+		touch(np);
+		jp->j_cstat = MAKE_DIDSOMETHING;
+	}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	close_output(jp->j_output);
+	if (jp->j_cstat)
+		record_job(jp, (jp->j_cstat & MAKE_FAILURE) ? jp->j_xstat : 0);
+	jp->j_start.tv_sec = 0;
+#endif
+	curr_cmd = NULL;
+	return TRUE;
+}
+
+/*
+ * A command line run in the background has finished.  Carry on with
+ * the target's remaining commands.  Return TRUE if there are none.
+ */
+static int
+resume_cmds(struct job *jp, int status)
+{
+	curr_cmd = jp->j_cmd;
+	jp->j_pid = 0;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if (syncline || (jp->j_name->n_flag & N_SYNCLINE))
+		flush_output(jp->j_output);
+#endif
+	if (command_done(jp, status))
+		jp->j_cmd = jp->j_cmd->c_next;
+	else
+		jp->j_cmd = NULL;
+	return docmds(jp);
+}
+
+/*
+ * Determine if the modification time of a target, t, is less than
+ * that of a prerequisite, p.  If the tv_nsec member of either is
+ * exactly 0 we assume (possibly incorrectly) that the time resolution
+ * is 1 second and only compare tv_sec values.
+ */
+static int
+timespec_le(const struct timespec *t, const struct timespec *p)
+{
+	if (t->tv_nsec == 0 || p->tv_nsec == 0)
+		return t->tv_sec <= p->tv_sec;
+	else if (t->tv_sec < p->tv_sec)
+		return TRUE;
+	else if (t->tv_sec == p->tv_sec)
+		return t->tv_nsec <= p->tv_nsec;
+	return FALSE;
+}
+
+/*
+ * Return the greater of two struct timespecs
+ */
+static const struct timespec *
+timespec_max(const struct timespec *t, const struct timespec *p)
+{
+	return timespec_le(t, p) ? p : t;
+}
+
+/*
+ * Prepare to make the prerequisites of the job's current rule.
+ */
+static void
+begin_rule(struct job *jp)
+{
+	struct rule *rp = jp->j_rule;
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	// Each double-colon rule is handled separately.
+	if (rp && (jp->j_name->n_flag & N_DOUBLE)) {
+		jp->j_implicit = NULL;
+		// If the rule has no commands use the inference rule.
+		// Unless there isn't one, as allowed for phony targets.
+		if (!rp->r_cmd && jp->j_impdep) {
+			jp->j_implicit = jp->j_impdep;
+			jp->j_infrule.r_dep->d_next = rp->r_dep;
+			rp->r_dep = jp->j_infrule.r_dep;
+			rp->r_cmd = jp->j_infrule.r_cmd;
+		}
+		// A rule with no prerequisities is executed unconditionally.
+		if (!rp->r_dep)
+			jp->j_dtim = jp->j_name->n_tim;
+	}
+#endif
+	jp->j_dep = rp ? rp->r_dep : NULL;
+}
+
+/*
+ * Make the prerequisites of the job's current rule or, for targets
+ * that don't have double-colon rules, of all its rules.  Return TRUE
+ * if they've all been made, FALSE if some have still to be made.
+ *
+ * Prerequisites following a .WAIT aren't started until those before
+ * it have been made.
+ */
+static int
+make_deps(struct job *jp)
+{
+	struct name *np = jp->j_name;
+	struct depend *dp;
+
+	for (;;) {
+		while ((dp = jp->j_dep)) {
+			struct name *pp = dp->d_name;
+			int estat;
+
+			if ((pp->n_flag & N_WAIT)) {
+				if (jp->j_pending)
+					return FALSE;
+				jp->j_dep = dp->d_next;
+				continue;
+			}
+
+			jp->j_dep = dp->d_next;
+			if (pp->n_job)
+				raise_chain(pp->n_job, jp->j_chain);
+			estat = make0(pp, jp->j_level + 1, jp->j_chain);
+			if (pp->n_job) {
+				// Arrange to be told when the prerequisite has been made
+				struct depend *wp;
+
+				newdep(np, &wp);
+				wp->d_next = pp->n_job->j_waiting;
+				pp->n_job->j_waiting = wp;
+				jp->j_pending++;
+			} else {
+				jp->j_estat |= estat;
+			}
+		}
+		if ((np->n_flag & N_DOUBLE) || jp->j_rule == NULL ||
+				(jp->j_rule = jp->j_rule->r_next) == NULL)
+			break;
+		jp->j_dep = jp->j_rule->r_dep;
+	}
+	return jp->j_pending == 0;
+}
+
+/*
+ * Start the commands for the job's current rule.  Return FALSE if
+ * they're waiting to be run in the background.
+ */
+static int
+start_cmds(struct job *jp, struct cmd *cp)
+{
+	jp->j_cmd = cp;
+	jp->j_cstat = 0;
+	IF_FEATURE_MAKE_EXTENSIONS(if (jp->j_batch) jp->j_batch->b_pending++;)
+	if (maxjobs > 1) {
+		enqueue(jp);
+		return FALSE;
+	}
+
+	internal_macros(jp);
+	docmds(jp);
+	IF_FEATURE_MAKE_EXTENSIONS(if (batch_done(jp)) return FALSE;)
+	jp->j_estat |= jp->j_cstat;
+	return TRUE;
+}
+
+/*
+ * Make the strings of out-of-date prerequisites (for $?), all
+ * prerequisites (for $+) and deduplicated prerequisites (for $^) for
+ * the job's current rule, if they haven't been made already.
+ */
+static void
+prereq_lists(struct job *jp)
+{
+	struct name *np = jp->j_name;
+	struct rule *rp, *rp_end;
+	struct depend *dp;
+
+	if (jp->j_lists)
+		return;
+	jp->j_lists = TRUE;
+
+	// For double-colon rules only the current rule is considered
+	if ((np->n_flag & N_DOUBLE)) {
+		rp = jp->j_rule;
+		rp_end = rp ? rp->r_next : NULL;
+	} else {
+		rp = np->n_rule;
+		rp_end = NULL;
+	}
+
+#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
+	// Reset flag to detect duplicate prerequisites
+	for (struct rule *rp1 = rp; rp1 != rp_end; rp1 = rp1->r_next) {
+		for (dp = rp1->r_dep; dp; dp = dp->d_next) {
+			dp->d_name->n_flag &= ~N_MARK;
+		}
+	}
+#endif
+
+	for (; rp != rp_end; rp = rp->r_next) {
+		for (dp = rp->r_dep; dp; dp = dp->d_next) {
+			if ((dp->d_name->n_flag & N_WAIT))
+				continue;
+			if (timespec_le(&np->n_tim, &dp->d_name->n_tim)) {
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+				if (posix || !(dp->d_name->n_flag & N_MARK))
+#endif
+					addword(&jp->j_oodate, dp->d_name->n_name);
+			}
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+			addword(&jp->j_allsrc, dp->d_name->n_name);
+			if (!(dp->d_name->n_flag & N_MARK))
+				addword(&jp->j_dedup, dp->d_name->n_name);
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
+			dp->d_name->n_flag |= N_MARK;
+#endif
+		}
+	}
+}
+
 /*
- * Do commands to make a target
+ * Called when $?, $^ or $+ is about to be expanded.  The strings of
+ * prerequisites can be long, so they're only made and assigned to the
+ * macros when a command of the job the internal macros are for uses
+ * one of them.
  */
-static int
-docmds(struct name *np, struct cmd *cp)
+void
+prereq_macros(void)
 {
-	int estat = 0;
-	char *q, *command;
+	struct job *jp = macro_job;
 
-	for (; cp; cp = cp->c_next) {
-		uint32_t ssilent, signore, sdomake;
+	if (!jp || macro_lists)
+		return;
+	macro_lists = TRUE;
 
-		// Location of command in makefile (for use in error messages)
-		curr_cmd = cp;
+	prereq_lists(jp);
+	setmacro("?", jp->j_oodate.w_buf, 0 | M_VALID);
 #if ENABLE_FEATURE_MAKE_POSIX_2024
-		opts &= ~OPT_make;	// We want to know if $(MAKE) is expanded
+	if (!POSIX_2017) {
+		setmacro("+", jp->j_allsrc.w_buf, 0 | M_VALID);
+		setmacro("^", jp->j_dedup.w_buf, 0 | M_VALID);
+	}
 #endif
-		q = command = expand_macros(cp->c_cmd, FALSE);
-		ssilent = silent || (np->n_flag & N_SILENT) || dotouch;
-		signore = ignore || (np->n_flag & N_IGNORE);
-		sdomake = (!dryrun || doinclude || domake) && !dotouch;
-		for (;;) {
-			if (*q == '@')	// Specific silent
-				ssilent = TRUE + 1;
-			else if (*q == '-')	// Specific ignore
-				signore = TRUE;
-			else if (*q == '+')	// Specific domake
-				sdomake = TRUE + 1;
-			else
-				break;
-			do {
-				q++;
-			} while (isblank(*q));
-		}
+}
 
-		if (sdomake > TRUE) {
-			// '+' must not override '@' or .SILENT
-			if (ssilent != TRUE + 1 && !(np->n_flag & N_SILENT))
-				ssilent = FALSE;
-		} else if (!sdomake)
-			ssilent = dotouch;
+/*
+ * The prerequisites of the job's current rule have been made.  Work
+ * out if the target is out-of-date and, if so, start the commands to
+ * rebuild it.  Return FALSE if the commands haven't finished.
+ */
+static int
+make_rule(struct job *jp)
+{
+	struct name *np = jp->j_name;
+	struct rule *rp, *rp_end;
+	struct depend *dp;
 
-		if (!ssilent && *q != '\0') {	// Ignore empty commands
-			puts(q);
-			fflush(stdout);
-		}
+	// For double-colon rules only the current rule is considered
+	if ((np->n_flag & N_DOUBLE)) {
+		rp = jp->j_rule;
+		rp_end = rp ? rp->r_next : NULL;
+	} else {
+		rp = np->n_rule;
+		rp_end = NULL;
+	}
 
-		if (quest && sdomake != TRUE + 1) {
-			// MAKE_FAILURE means rebuild is needed
-			estat |= MAKE_FAILURE | MAKE_DIDSOMETHING;
-			continue;
+	for (; rp != rp_end; rp = rp->r_next) {
+		for (dp = rp->r_dep; dp; dp = dp->d_next) {
+			if ((dp->d_name->n_flag & N_WAIT))
+				continue;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+			if (!jp->j_first && timespec_le(&np->n_tim, &dp->d_name->n_tim))
+				jp->j_first = dp->d_name;
+#endif
+			jp->j_dtim = *timespec_max(&jp->j_dtim, &dp->d_name->n_tim);
 		}
+	}
 
-		if (sdomake && *q != '\0') {	// Ignore empty commands
-			// Get the shell to execute it
-			int status;
-			char *cmd = !signore IF_FEATURE_MAKE_EXTENSIONS(&& posix) ?
-							xconcat3("set -e;", q, "") : q;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	// The history needs the prerequisites as they are now
+	if (history_file)
+		prereq_lists(jp);
+#endif
 
-			target = np;
-			status = system(cmd);
-			if (!signore IF_FEATURE_MAKE_EXTENSIONS(&& posix))
-				free(cmd);
-			// If this command was being run to create an include file
-			// or bring it up-to-date errors should be ignored and a
-			// failure status returned.
-			if (status == -1 && !doinclude) {
-				error("couldn't execute '%s'", q);
-			} else if (status != 0 && !signore) {
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-				if (!posix && WIFSIGNALED(status))
-					remove_target();
-#endif
-				if (doinclude) {
-					warning("failed to build '%s'", np->n_name);
-				} else {
-					const char *err_type = NULL;
-					int err_value = 1;
-
-					if (WIFEXITED(status)) {
-						err_type = "exit";
-						err_value = WEXITSTATUS(status);
-					} else if (WIFSIGNALED(status)) {
-						err_type = "signal";
-						err_value = WTERMSIG(status);
-					}
-
-					if (!quest || err_value == 127) {
-						if (err_type)
-							diagnostic("failed to build '%s' %s %d",
-									np->n_name, err_type, err_value);
-						else
-							diagnostic("failed to build '%s'", np->n_name);
-					}
-
-					if (errcont) {
-						estat |= MAKE_FAILURE;
-						free(command);
-						break;
-					}
-					exit(2);
-				}
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if ((np->n_flag & N_DOUBLE)) {
+		if (((np->n_flag & N_PHONY) ||
+				timespec_le(&np->n_tim, &jp->j_dtim))) {
+			if (!(jp->j_estat & MAKE_FAILURE)) {
+				jp->j_dtim = (struct timespec){1, 0};
+				return start_cmds(jp, jp->j_rule->r_cmd);
 			}
-			target = NULL;
 		}
-		if (sdomake || dryrun)
-			estat = MAKE_DIDSOMETHING;
-		free(command);
+		return TRUE;
 	}
+#endif
 
-	if (dotouch && !(np->n_flag & N_PHONY) && !(estat & MAKE_DIDSOMETHING)) {
-		touch(np);
-		estat = MAKE_DIDSOMETHING;
+	if ((np->n_flag & N_PHONY) || timespec_le(&np->n_tim, &jp->j_dtim)) {
+		if (!(jp->j_estat & MAKE_FAILURE)) {
+			if (jp->j_sccmd)
+				return start_cmds(jp, jp->j_sccmd);
+			else if (!doinclude && jp->j_level == 0 &&
+						!(jp->j_estat & MAKE_DIDSOMETHING))
+				warning("nothing to be done for %s", np->n_name);
+		} else if (!doinclude && !quest) {
+			diagnostic("'%s' not built due to errors", np->n_name);
+		}
 	}
-
-	curr_cmd = NULL;
-	return estat;
+	return TRUE;
 }
 
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
 /*
- * Remove the suffix from a name, either the one provided in 'tsuff'
- * or, if 'tsuff' is NULL, one of the known suffixes.
+ * Tidy up after the job's current rule and move on to the next, if
+ * the target has double-colon rules.  Return FALSE if there are no
+ * more rules.
  */
-static char *
-remove_suffix(const char *name, const char *tsuff)
+static int
+next_rule(struct job *jp)
 {
-	char *base = NULL;
+	free(jp->j_oodate.w_buf);
+	jp->j_oodate = (struct words){NULL, 0, 0};
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+	free(jp->j_allsrc.w_buf);
+	free(jp->j_dedup.w_buf);
+	jp->j_allsrc = jp->j_dedup = (struct words){NULL, 0, 0};
+#endif
+	jp->j_lists = FALSE;
+	IF_FEATURE_MAKE_EXTENSIONS(jp->j_first = NULL;)
 
-	if (tsuff != NULL) {
-		base = has_suffix(name, tsuff);
-	} else {
-		struct name *xp = newname(".SUFFIXES");
-		for (struct rule *rp = xp->n_rule; rp; rp = rp->r_next) {
-			for (struct depend *dp = rp->r_dep; dp; dp = dp->d_next) {
-				base = has_suffix(name, dp->d_name->n_name);
-				if (base) {
-					return base;
-				}
-			}
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	if ((jp->j_name->n_flag & N_DOUBLE) && jp->j_rule) {
+		struct rule *rp = jp->j_rule;
+
+		if (jp->j_implicit) {
+			rp->r_dep = rp->r_dep->d_next;
+			rp->r_cmd = NULL;
+		}
+		if ((jp->j_rule = rp->r_next)) {
+			begin_rule(jp);
+			return TRUE;
 		}
 	}
-	return base;
-}
 #endif
+	return FALSE;
+}
 
-#if !ENABLE_FEATURE_MAKE_POSIX_2024 && !ENABLE_FEATURE_MAKE_EXTENSIONS
-# define make1(n, c, o, a, d, i, t) make1(n, c, o, i)
-#elif ENABLE_FEATURE_MAKE_POSIX_2024 && !ENABLE_FEATURE_MAKE_EXTENSIONS
-# define make1(n, c, o, a, d, i, t) make1(n, c, a, d, o, i)
-#elif !ENABLE_FEATURE_MAKE_POSIX_2024 && ENABLE_FEATURE_MAKE_EXTENSIONS
-# define make1(n, c, o, a, d, i, t) make1(n, c, o, i, t)
-#endif
+/*
+ * The target of a job has been made.  Tidy up and continue with any
+ * targets that were waiting for it.  Return the status of the target.
+ */
 static int
-make1(struct name *np, struct cmd *cp, char *oodate, char *allsrc,
-		char *dedup, struct name *implicit, const char *tsuff)
+finish(struct job *jp)
 {
-	char *name, *member = NULL, *base = NULL, *prereq = NULL;
+	struct name *np = jp->j_name;
+	struct depend *dp;
+	int estat = jp->j_estat;
 
-	name = splitlib(np->n_name, &member);
-	setmacro("?", oodate, 0 | M_VALID);
-#if ENABLE_FEATURE_MAKE_POSIX_2024
-	if (!POSIX_2017) {
-		setmacro("+", allsrc, 0 | M_VALID);
-		setmacro("^", dedup, 0 | M_VALID);
-	}
-#endif
-	setmacro("%", member, 0 | M_VALID);
-	setmacro("@", name, 0 | M_VALID);
-	if (implicit IF_FEATURE_MAKE_EXTENSIONS(|| !posix)) {
-		char *s;
+	np->n_flag |= N_DONE;
+	np->n_flag &= ~N_DOING;
+	np->n_job = NULL;
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-		// As an extension, if we're not dealing with an implicit
-		// prerequisite set $< to the first out-of-date prerequisite.
-		if (implicit == NULL) {
-			if (oodate) {
-				s = strchr(oodate, ' ');
-				if (s)
-					*s = '\0';
-				prereq = oodate;
-			}
-		} else
+	if ((np->n_flag & N_DOUBLE) && jp->j_impdep) {
+		// Only the implicit prerequisite belongs to the job
+		jp->j_infrule.r_dep->d_next = NULL;
+		freedeps(jp->j_infrule.r_dep);
+	}
 #endif
-			prereq = implicit->n_name;
 
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-		if (!posix && member == NULL) {
-			// As an extension remove a suffix that doesn't necessarily
-			// start with a period from a target, but not for targets
-			// of the form lib.a(member.o).
-			base = remove_suffix(name, tsuff);
-			if (base) {
-				free(name);
-				name = base;
-			}
-		} else
-#endif
-		{
-			base = member ? member : name;
-			s = suffix(base);
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-			// As an extension, if we're not dealing with an implicit
-			// prerequisite and the target ends with a known suffix,
-			// remove it and set $* to the stem, else to an empty string.
-			if (implicit == NULL && !is_suffix(s))
-				base = NULL;
-			else
-#endif
-				*s = '\0';
-		}
+	if (estat & MAKE_DIDSOMETHING) {
+		modtime(np);
+		if (!np->n_tim.tv_sec)
+			clock_gettime(CLOCK_REALTIME, &np->n_tim);
+	} else if (!quest && jp->j_level == 0 &&
+				!timespec_le(&np->n_tim, &jp->j_dtim))
+		printf("%s: '%s' is up to date\n", myname, np->n_name);
+
+	for (dp = jp->j_waiting; dp; dp = dp->d_next) {
+		struct job *wp = dp->d_name->n_job;
+
+		wp->j_estat |= estat;
+		if (--wp->j_pending == 0)
+			progress(wp);
 	}
-	setmacro("<", prereq, 0 | M_VALID);
-	setmacro("*", base, 0 | M_VALID);
-	free(name);
+	freedeps(jp->j_waiting);
 
-	return docmds(np, cp);
+	if (np == goal)
+		goal_estat = estat;
+	if (macro_job == jp)
+		macro_job = NULL;
+	free(jp);
+	return estat;
 }
 
 /*
- * Determine if the modification time of a target, t, is less than
- * that of a prerequisite, p.  If the tv_nsec member of either is
- * exactly 0 we assume (possibly incorrectly) that the time resolution
- * is 1 second and only compare tv_sec values.
+ * Make as much progress as possible with a job.  If its target has
+ * been made return its status, otherwise return 0.
  */
 static int
-timespec_le(const struct timespec *t, const struct timespec *p)
+progress(struct job *jp)
 {
-	if (t->tv_nsec == 0 || p->tv_nsec == 0)
-		return t->tv_sec <= p->tv_sec;
-	else if (t->tv_sec < p->tv_sec)
-		return TRUE;
-	else if (t->tv_sec == p->tv_sec)
-		return t->tv_nsec <= p->tv_nsec;
-	return FALSE;
+	struct name *np = jp->j_name;
+
+	np->n_flag |= N_DOING;
+	while (make_deps(jp) && make_rule(jp)) {
+		if (!next_rule(jp))
+			return finish(jp);
+	}
+	np->n_flag &= ~N_DOING;
+	return 0;
 }
 
 /*
- * Return the greater of two struct timespecs
+ * The commands for the job's current rule have finished.
  */
-static const struct timespec *
-timespec_max(const struct timespec *t, const struct timespec *p)
+static void
+end_cmds(struct job *jp)
 {
-	return timespec_le(t, p) ? p : t;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	struct job *mp, *next;
+
+	if (batch_done(jp))
+		return;
+	// The batch of members has been added to the archive
+	if (jp->j_arcmd) {
+		freecmds(jp->j_arcmd);
+		jp->j_arcmd = NULL;
+		for (mp = jp->j_members, jp->j_members = NULL; mp; mp = next) {
+			next = mp->j_next;
+			mp->j_cstat |= jp->j_cstat;
+			end_cmds(mp);
+		}
+	}
+#endif
+	jp->j_estat |= jp->j_cstat;
+	if (next_rule(jp))
+		progress(jp);
+	else
+		finish(jp);
 }
 
 /*
- * Recursive routine to make a target.
+ * Start making a target.  If it can be made without waiting for
+ * anything return its status.  Otherwise the target is left with a
+ * job that will be completed later and 0 is returned.  'chain' is the
+ * time expected to make the targets which need this one.
  */
-int
-make(struct name *np, int level)
+static int
+make0(struct name *np, int level, unsigned long chain)
 {
-	struct depend *dp;
-	struct rule *rp;
+	struct job *jp;
 	struct name *impdep = NULL;	// implicit prerequisite
 	struct rule infrule;
 	struct cmd *sc_cmd = NULL;	// commands for single-colon rule
-	char *oodate = NULL;
-#if ENABLE_FEATURE_MAKE_POSIX_2024
-	char *allsrc = NULL;
-	char *dedup = NULL;
-#endif
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 	const char *tsuff = NULL;
 #endif
-	struct timespec dtim = {1, 0};
-	int estat = 0;
 
 	if (np->n_flag & N_DONE)
 		return 0;
 	if (np->n_flag & N_DOING)
 		error("circular dependency for %s", np->n_name);
+	if (np->n_job)
+		return 0;	// Already being made
 	np->n_flag |= N_DOING;
 
+#if ENABLE_FEATURE_MAKE_PREFETCH
+	np->n_prefetch = FALSE;
+#endif
 	if (!np->n_tim.tv_sec)
 		modtime(np);		// Get modtime of this file
 
@@ -352,7 +1280,7 @@ make(struct name *np, int level)
 	else {
 		// If any double-colon rule has no commands we need
 		// an inference rule.
-		for (rp = np->n_rule; rp; rp = rp->r_next) {
+		for (struct rule *rp = np->n_rule; rp; rp = rp->r_next) {
 			if (!rp->r_cmd) {
 # if ENABLE_FEATURE_MAKE_POSIX_2024
 				// Phony targets don't need an inference rule.
@@ -371,123 +1299,189 @@ make(struct name *np, int level)
 	}
 #endif
 
-#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
-	// Reset flag to detect duplicate prerequisites
-	if (!(np->n_flag & N_DOUBLE)) {
-		for (rp = np->n_rule; rp; rp = rp->r_next) {
-			for (dp = rp->r_dep; dp; dp = dp->d_next) {
-				dp->d_name->n_flag &= ~N_MARK;
-			}
-		}
+	jp = xmalloc(sizeof(struct job));
+	memset(jp, 0, sizeof(struct job));
+	jp->j_name = np;
+	jp->j_level = level;
+	jp->j_chain = chain IF_FEATURE_MAKE_EXTENSIONS(+ target_time(np->n_name));
+	jp->j_index = -1;
+	jp->j_impdep = jp->j_implicit = impdep;
+	if (impdep)
+		jp->j_infrule = infrule;
+	jp->j_sccmd = sc_cmd;
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+	jp->j_tsuff = tsuff;
+	jp->j_output[0] = jp->j_output[1] = -1;
+	if (impdep && impdep != np) {
+		struct cmd *cp = batch_cmds(jp, impdep);
+
+		if (cp)
+			jp->j_sccmd = cp;
 	}
 #endif
+	jp->j_dtim = (struct timespec){1, 0};
+	jp->j_rule = np->n_rule;
+	np->n_job = jp;
+	begin_rule(jp);
+
+	return progress(jp);
+}
 
-	for (rp = np->n_rule; rp; rp = rp->r_next) {
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-		struct name *locdep = NULL;
+/*
+ * Add a batch of members to their archive, and remove the files, as
+ * a job for one of the members.  A batch is only added when no other
+ * members of the archive are being made, unless 'force' is TRUE.
+ * Return FALSE if there was no batch to add.
+ */
+static int
+flush_batches(int force)
+{
+	struct batch *bp;
+	struct job *jp, *mp, *next, *members = NULL;
+	struct cmd *cp;
+	struct words files = {NULL, 0, 0};
+	char *member, *name, *s, *t;
 
-		// Each double-colon rule is handled separately.
-		if ((np->n_flag & N_DOUBLE)) {
-			// If the rule has no commands use the inference rule.
-			// Unless there isn't one, as allowed for phony targets.
-			if (!rp->r_cmd) {
-# if ENABLE_FEATURE_MAKE_POSIX_2024
-				if (impdep)
-# endif
-				{
-					locdep = impdep;
-					infrule.r_dep->d_next = rp->r_dep;
-					rp->r_dep = infrule.r_dep;
-					rp->r_cmd = infrule.r_cmd;
-				}
-			}
-			// A rule with no prerequisities is executed unconditionally.
-			if (!rp->r_dep)
-				dtim = np->n_tim;
-			// Reset flag to detect duplicate prerequisites
-			for (dp = rp->r_dep; dp; dp = dp->d_next) {
-				dp->d_name->n_flag &= ~N_MARK;
-			}
-		}
-#endif
-		for (dp = rp->r_dep; dp; dp = dp->d_next) {
-			// Make prerequisite
-			estat |= make(dp->d_name, level + 1);
+	for (bp = batches; bp; bp = bp->b_next) {
+		if (bp->b_done && (bp->b_pending == 0 || force))
+			break;
+	}
+	if (!bp)
+		return FALSE;
 
-			// Make strings of out-of-date prerequisites (for $?),
-			// all prerequisites (for $+) and deduplicated prerequisites
-			// (for $^).
-			if (timespec_le(&np->n_tim, &dp->d_name->n_tim)) {
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-				if (posix || !(dp->d_name->n_flag & N_MARK))
-#endif
-					oodate = xappendword(oodate, dp->d_name->n_name);
-			}
-#if ENABLE_FEATURE_MAKE_POSIX_2024
-			allsrc = xappendword(allsrc, dp->d_name->n_name);
-			if (!(dp->d_name->n_flag & N_MARK))
-				dedup = xappendword(dedup, dp->d_name->n_name);
-#endif
-#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
-			dp->d_name->n_flag |= N_MARK;
+	// The members are added in the order they were made
+	for (jp = bp->b_done, bp->b_done = NULL; jp; jp = next) {
+		next = jp->j_next;
+		jp->j_next = members;
+		members = jp;
+	}
+	for (mp = members; mp; mp = mp->j_next) {
+		member = NULL;
+		name = splitlib(mp->j_name->n_name, &member);
+		addword(&files, member);
+		free(name);
+	}
+	jp = members;
+	jp->j_members = jp->j_next;
+	jp->j_next = NULL;
+
+	s = xconcat3("$(AR) $(ARFLAGS) ", bp->b_archive, " ");
+	t = xconcat3(s, files.w_buf, "");
+	free(s);
+	s = xconcat3("rm -f ", files.w_buf, "");
+	newcmd(s, newcmd(t, &cp));
+	free(t);
+	free(s);
+	free(files.w_buf);
+
+	jp->j_arcmd = jp->j_cmd = cp;
+	jp->j_cstat = 0;
+	if (maxjobs > 1) {
+		enqueue(jp);
+	} else {
+		internal_macros(jp);
+		docmds(jp);
+		end_cmds(jp);
+	}
+	return TRUE;
+}
 #endif
-			dtim = *timespec_max(&dtim, &dp->d_name->n_tim);
+
+/*
+ * Start the commands of as many jobs in the run queue as possible.
+ * Jobs which would update an archive already being updated are held
+ * back until that's done.
+ */
+static void
+start_jobs(void)
+{
+	struct job *jp;
+
+	IF_FEATURE_MAKE_EXTENSIONS(while (flush_batches(FALSE));)
+	while (nrunq && job_slot(nrunning)) {
+		jp = dequeue();
+		if (archive_busy(jp)) {
+			jp->j_next = NULL;
+			*held_end = jp;
+			held_end = &jp->j_next;
+			continue;
 		}
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-		if ((np->n_flag & N_DOUBLE)) {
-			if (((np->n_flag & N_PHONY) || timespec_le(&np->n_tim, &dtim))) {
-				if (!(estat & MAKE_FAILURE)) {
-					estat |= make1(np, rp->r_cmd, oodate, allsrc,
-										dedup, locdep, tsuff);
-					dtim = (struct timespec){1, 0};
-				}
-				free(oodate);
-				oodate = NULL;
-			}
-#if ENABLE_FEATURE_MAKE_POSIX_2024
-			free(allsrc);
-			free(dedup);
-			allsrc = dedup = NULL;
-#endif
-			if (locdep) {
-				rp->r_dep = rp->r_dep->d_next;
-				rp->r_cmd = NULL;
-			}
+		internal_macros(jp);
+		if (docmds(jp)) {
+			end_cmds(jp);
+		} else {
+			jp->j_next = running;
+			running = jp;
+			nrunning++;
 		}
-#endif
 	}
-#if ENABLE_FEATURE_MAKE_EXTENSIONS
-	if ((np->n_flag & N_DOUBLE) && impdep)
-		free(infrule.r_dep);
-#endif
+	release_slots(nrunning);
+}
 
-	np->n_flag |= N_DONE;
-	np->n_flag &= ~N_DOING;
+/*
+ * Wait for a command running in the background to finish and carry
+ * on with its job.
+ */
+static void
+reap_job(void)
+{
+	struct job *jp, **jpp;
+	pid_t pid;
+	int status;
 
-	if (!(np->n_flag & N_DOUBLE) &&
-				((np->n_flag & N_PHONY) || (timespec_le(&np->n_tim, &dtim)))) {
-		if (!(estat & MAKE_FAILURE)) {
-			if (sc_cmd)
-				estat |= make1(np, sc_cmd, oodate, allsrc, dedup,
-								impdep, tsuff);
-			else if (!doinclude && level == 0 && !(estat & MAKE_DIDSOMETHING))
-				warning("nothing to be done for %s", np->n_name);
-		} else if (!doinclude && !quest) {
-			diagnostic("'%s' not built due to errors", np->n_name);
+	// If jobs are waiting to run a token from the jobserver will do too
+	pid = wait_command(&status, nrunq != 0);
+	for (jpp = &running; (jp = *jpp); jpp = &jp->j_next) {
+		if (jp->j_pid == pid) {
+			*jpp = jp->j_next;
+			nrunning--;
+			if (resume_cmds(jp, status)) {
+				// Jobs held back may be able to update their archive
+				for (struct job *hp = held, *next; hp; hp = next) {
+					next = hp->j_next;
+					enqueue(hp);
+				}
+				held = NULL;
+				held_end = &held;
+				end_cmds(jp);
+			} else {
+				jp->j_next = running;
+				running = jp;
+				nrunning++;
+			}
+			break;
 		}
-		free(oodate);
 	}
+	release_slots(nrunning);
+}
 
-	if (estat & MAKE_DIDSOMETHING) {
-		modtime(np);
-		if (!np->n_tim.tv_sec)
-			clock_gettime(CLOCK_REALTIME, &np->n_tim);
-	} else if (!quest && level == 0 && !timespec_le(&np->n_tim, &dtim))
-		printf("%s: '%s' is up to date\n", myname, np->n_name);
+/*
+ * Make a target, including any of its prerequisites.  In a parallel
+ * build wait until all the commands needed have been run.
+ */
+int
+make(struct name *np, int level)
+{
+	int estat = make0(np, level, 0);
 
-#if ENABLE_FEATURE_MAKE_POSIX_2024
-	free(allsrc);
-	free(dedup);
-#endif
+	if (np->n_job) {
+		goal = np;
+		for (;;) {
+			start_jobs();
+			if (!np->n_job)
+				break;
+			if (!running) {
+				// Members of an archive may be waiting for others
+				// which depend on them.
+				if (IF_FEATURE_MAKE_EXTENSIONS(flush_batches(TRUE) ||) 0)
+					continue;
+				error("circular dependency for %s", np->n_name);
+			}
+			reap_job();
+		}
+		goal = NULL;
+		estat = goal_estat;
+	}
 	return estat;
 }
@@ -5,6 +5,8 @@
 #if defined(__sun__)
 # define __EXTENSIONS__
 #endif
+#include <sys/resource.h>
+#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -15,6 +17,7 @@
 #include <libgen.h>
 #include <limits.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -88,6 +91,33 @@ extern char **environ;
 # define POSIX_2017 FALSE
 #endif
 
+// If ENABLE_FEATURE_MAKE_PREFETCH is non-zero the modification times
+// of the files a build may need are fetched by a pool of threads before
+// the build starts.
+#ifndef ENABLE_FEATURE_MAKE_PREFETCH
+# define ENABLE_FEATURE_MAKE_PREFETCH 1
+#endif
+
+// If ENABLE_FEATURE_MAKE_DIRCACHE is non-zero the files which might be
+// prerequisites found by inference rules are looked up in a cached
+// listing of their directory before their modification time is fetched.
+// It's off by default on macOS, where filesystems usually ignore case.
+#ifndef ENABLE_FEATURE_MAKE_DIRCACHE
+# if defined(__APPLE__)
+#  define ENABLE_FEATURE_MAKE_DIRCACHE 0
+# else
+#  define ENABLE_FEATURE_MAKE_DIRCACHE 1
+# endif
+#endif
+
+// If ENABLE_FEATURE_MAKE_IO_URING is non-zero the prefetch is done on
+// Linux by submitting batches of statx(2) requests to an io_uring rather
+// than by threads.  The threads are still used if io_uring isn't
+// available.
+#ifndef ENABLE_FEATURE_MAKE_IO_URING
+# define ENABLE_FEATURE_MAKE_IO_URING 0
+#endif
+
 // If ENABLE_FEATURE_CLEAN_UP is non-zero all allocated structures are
 // freed at the end of main().  This isn't necessary but it's a nice test.
 #ifndef ENABLE_FEATURE_CLEAN_UP
@@ -97,6 +127,7 @@ extern char **environ;
 #define TRUE		(1)
 #define FALSE		(0)
 #define MAX(a,b)	((a)>(b)?(a):(b))
+#define MIN(a,b)	((a)<(b)?(a):(b))
 
 #if defined(__GLIBC__) && ENABLE_FEATURE_MAKE_EXTENSIONS
 // By default GNU libc getopt(3) allows options and non-options to be
@@ -112,7 +143,7 @@ extern char **environ;
 #endif
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
-#define OPTSTR1 "+ehij:knqrsSt"
+#define OPTSTR1 "+ehij:kl:nqrsSt"
 #elif ENABLE_FEATURE_MAKE_POSIX_2024
 #define OPTSTR1 "+eij:knqrsSt"
 #else
@@ -130,6 +161,7 @@ enum {
 	OPTBIT_i,
 	IF_FEATURE_MAKE_POSIX_2024(OPTBIT_j,)
 	OPTBIT_k,
+	IF_FEATURE_MAKE_EXTENSIONS(OPTBIT_l,)
 	OPTBIT_n,
 	OPTBIT_q,
 	OPTBIT_r,
@@ -144,12 +176,17 @@ enum {
 	IF_FEATURE_MAKE_POSIX_2024(OPTBIT_phony,)
 	IF_FEATURE_MAKE_POSIX_2024(OPTBIT_include,)
 	IF_FEATURE_MAKE_POSIX_2024(OPTBIT_make,)
+	IF_FEATURE_MAKE_EXTENSIONS(OPTBIT_oneshell,)
+	IF_FEATURE_MAKE_EXTENSIONS(OPTBIT_syncout,)
+	IF_FEATURE_MAKE_EXTENSIONS(OPTBIT_syncline,)
+	IF_FEATURE_MAKE_EXTENSIONS(OPTBIT_batch,)
 
 	OPT_e = (1 << OPTBIT_e),
 	OPT_h = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_h)) + 0,
 	OPT_i = (1 << OPTBIT_i),
 	OPT_j = IF_FEATURE_MAKE_POSIX_2024((1 << OPTBIT_j)) + 0,
 	OPT_k = (1 << OPTBIT_k),
+	OPT_l = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_l)) + 0,
 	OPT_n = (1 << OPTBIT_n),
 	OPT_q = (1 << OPTBIT_q),
 	OPT_r = (1 << OPTBIT_r),
@@ -166,6 +203,10 @@ enum {
 	OPT_phony = IF_FEATURE_MAKE_POSIX_2024((1 << OPTBIT_phony)) + 0,
 	OPT_include = IF_FEATURE_MAKE_POSIX_2024((1 << OPTBIT_include)) + 0,
 	OPT_make = IF_FEATURE_MAKE_POSIX_2024((1 << OPTBIT_make)) + 0,
+	OPT_oneshell = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_oneshell)) + 0,
+	OPT_syncout = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_syncout)) + 0,
+	OPT_syncline = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_syncline)) + 0,
+	OPT_batch = IF_FEATURE_MAKE_EXTENSIONS((1 << OPTBIT_batch)) + 0,
 };
 
 // Options in OPTSTR1 that aren't included in MAKEFLAGS
@@ -183,14 +224,24 @@ enum {
 #define precious  (opts & OPT_precious)
 #define doinclude (opts & OPT_include)
 #define domake    (opts & OPT_make)
+#define oneshell  (opts & OPT_oneshell)
+#define syncout   (opts & OPT_syncout)
+#define syncline  (opts & OPT_syncline)
+#define batchar   (opts & OPT_batch)
 
 // A name.  This represents a file, either to be made, or pre-existing.
 struct name {
 	struct name *n_next;	// Next in the list of names
 	char *n_name;			// Called
+	unsigned int n_hash;	// Hash of name
 	struct rule *n_rule;	// Rules to build this (prerequisites/commands)
+	struct rule *n_last;	// Last of these rules, if there are any
 	struct timespec n_tim;	// Modification time of this name
+	struct job *n_job;		// Job making this name, if any
 	uint16_t n_flag;		// Info about the name
+#if ENABLE_FEATURE_MAKE_PREFETCH
+	bool n_prefetch;		// Time was prefetched and hasn't been used
+#endif
 };
 
 #define N_DOING		0x01	// Name in process of being built
@@ -205,7 +256,8 @@ struct name {
 #define N_SILENT	0x20	// Build target silently
 #define N_IGNORE	0x40	// Ignore build errors
 #define N_SPECIAL	0x80	// Special target
-#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
+#if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024 || \
+		ENABLE_FEATURE_MAKE_PREFETCH
 #define N_MARK		0x100	// Mark for deduplication
 #endif
 #if ENABLE_FEATURE_MAKE_POSIX_2024
@@ -214,6 +266,22 @@ struct name {
 #define N_PHONY		0		// No support for phony targets
 #endif
 #define N_INFERENCE	0x400	// Inference rule
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+#define N_WAIT		0x800	// .WAIT in a list of prerequisites
+#else
+#define N_WAIT		0		// No support for .WAIT
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+#define N_ONESHELL	0x1000	// Run all commands in one shell
+#define N_SYNCOUT	0x2000	// Collect output of commands for target
+#define N_SYNCLINE	0x4000	// Collect output of each command line
+#define N_BATCH		0x8000	// Add members to archive together
+#else
+#define N_ONESHELL	0		// No support for .ONESHELL
+#define N_SYNCOUT	0		// No support for .OUTPUT_SYNC
+#define N_SYNCLINE	0		// No support for .OUTPUT_SYNC_LINE
+#define N_BATCH		0		// No support for .BATCH_ARCHIVES
+#endif
 
 // List of rules to build a target
 struct rule {
@@ -234,9 +302,9 @@ struct depend {
 // List of commands for a rule
 struct cmd {
 	struct cmd *c_next;		// Next command line
-	char *c_cmd;			// Text of command line
+	const char *c_cmd;		// Text of command line (interned)
 	int c_refcnt;			// Reference count
-	const char *c_makefile;	// Makefile in which command was defined
+	const char *c_makefile;	// Makefile in which command was defined (interned)
 	int c_dispno;			// Line number within makefile
 };
 
@@ -244,6 +312,7 @@ struct cmd {
 struct macro {
 	struct macro *m_next;	// Next variable
 	char *m_name;			// Its name
+	unsigned int m_hash;	// Hash of name
 	char *m_val;			// Its value
 #if ENABLE_FEATURE_MAKE_EXTENSIONS || ENABLE_FEATURE_MAKE_POSIX_2024
 	bool m_immediate;		// Immediate-expansion macro set using ::=
@@ -258,6 +327,13 @@ struct file {
 	char *f_name;
 };
 
+// Space-separated string of words which grows as words are added
+struct words {
+	char *w_buf;			// The words, or NULL if none have been added
+	size_t w_len;			// Length of the string
+	size_t w_size;			// Size of the buffer
+};
+
 // Flags passed to setmacro()
 #define M_IMMEDIATE  0x08	// immediate-expansion macro is being defined
 #define M_VALID      0x10	// assert macro name is valid
@@ -293,16 +369,30 @@ enum {
 
 extern const char *myname;
 extern const char *makefile;
-extern struct name *namehead[HTABSIZE];
-extern struct macro *macrohead[HTABSIZE];
+extern struct file *makefiles;
+// Tables of names and macros.  The number of buckets is a power of 2
+// and grows with the number of entries.
+extern struct name **namehead;
+extern unsigned int namesize;
+extern unsigned int namecount;
+extern struct macro **macrohead;
+extern unsigned int macrosize;
+extern unsigned int macrocount;
 extern struct name *firstname;
 extern struct name *target;
 extern uint32_t opts;
 extern int lineno;
 extern int dispno;
 extern struct cmd *curr_cmd;
+extern char *shell;
+extern int maxjobs;
 #if ENABLE_FEATURE_MAKE_POSIX_2024
 extern char *numjobs;
+extern char *jobserver_auth;
+#endif
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+extern char *maxload;
+extern char *history_file;
 #endif
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 extern bool posix;
@@ -317,6 +407,25 @@ extern unsigned char posix_level;
 #define isfname(c) (ispname(c) || c == '-')
 
 void print_details(void);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+unsigned long target_time(const char *name);
+void read_history(void);
+void record_target(const char *name, unsigned long msecs, int status,
+		unsigned long utime, unsigned long stime, const char *prereqs);
+void free_history(void);
+int load_cache(void);
+void save_cache(void);
+void cache_makefile(const char *name);
+void disable_cache(void);
+int replay_include(const char *name);
+void begin_include(void);
+void end_include(void);
+void macro_used(const char *name, struct macro *mp);
+void record_macro(const char *name, const char *val, int level);
+void record_rule(struct name *np, uint16_t nflag, struct depend *dp,
+		struct cmd *cp, int dbl);
+void free_cache(void);
+#endif
 #if !ENABLE_FEATURE_MAKE_POSIX_2024
 #define expand_macros(s, e) expand_macros(s)
 #endif
@@ -325,13 +434,52 @@ void print_details(void);
 #endif
 char *expand_macros(const char *str, int except_dollar);
 void input(FILE *fd, int ilevel);
+struct macro *findmacro(const char *name);
 struct macro *getmp(const char *name);
 void setmacro(const char *name, const char *val, int level);
+void resize_macros(unsigned int size);
 void freemacros(void);
 void remove_target(void);
 int make(struct name *np, int level);
+void prereq_macros(void);
+void init_jobs(void);
+#if ENABLE_FEATURE_MAKE_POSIX_2024
+void share_jobserver(int share);
+#endif
+int job_slot(int n);
+void release_slots(int n);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+void open_output(int output[2]);
+void flush_output(const int output[2]);
+void close_output(int output[2]);
+#endif
+pid_t start_command(const char *cmd, int errexit, const int *output);
+int execute_command(const char *cmd, int errexit);
+pid_t wait_command(int *status, int token);
+#if ENABLE_FEATURE_MAKE_EXTENSIONS
+void command_usage(unsigned long *utime, unsigned long *stime);
+#endif
 char *splitlib(const char *name, char **member);
 void modtime(struct name *np);
+#if ENABLE_FEATURE_CLEAN_UP
+void free_archives(void);
+#endif
+#if ENABLE_FEATURE_MAKE_PREFETCH
+void prefetch_modtimes(char **targets);
+#endif
+#if ENABLE_FEATURE_MAKE_DIRCACHE
+int may_exist(const char *name);
+# if ENABLE_FEATURE_CLEAN_UP
+void free_dirs(void);
+# endif
+#else
+# define may_exist(name) TRUE
+#endif
+#if ENABLE_FEATURE_MAKE_DIRCACHE || ENABLE_FEATURE_MAKE_PREFETCH
+void files_changed(void);
+#else
+# define files_changed()
+#endif
 char *suffix(const char *name);
 const char *is_suffix(const char *s);
 char *has_suffix(const char *name, const char *suffix);
@@ -339,11 +487,15 @@ struct name *dyndep(struct name *np, struct rule *infrule, const char **ptsuff);
 char *getrules(char *s, int size);
 struct name *findname(const char *name);
 struct name *newname(const char *name);
+void resize_names(unsigned int size);
 struct cmd *getcmd(struct name *np);
 void freenames(void);
-struct depend *newdep(struct name *np, struct depend *dp);
+struct rule *alloc_rule(void);
+struct depend *alloc_dep(void);
+struct cmd *alloc_cmd(void);
+struct depend **newdep(struct name *np, struct depend **dpp);
 void freedeps(struct depend *dp);
-struct cmd *newcmd(char *str, struct cmd *cp);
+struct cmd **newcmd(char *str, struct cmd **cpp);
 void freecmds(struct cmd *cp);
 void freerules(struct rule *rp);
 void set_pragma(const char *name);
@@ -356,11 +508,19 @@ void error_not_allowed(const char *s, const char *t);
 void warning(const char *msg, ...);
 void *xmalloc(size_t len);
 void *xrealloc(void *ptr, size_t len);
+void *arena_alloc(size_t len);
+char *arena_strdup(const char *s);
+void free_arena(void);
 char *xconcat3(const char *s1, const char *s2, const char *s3);
 char *xstrdup(const char *s);
 char *xstrndup(const char *s, size_t n);
 char *xappendword(const char *str, const char *word);
+void addword(struct words *wp, const char *word);
+uint32_t fnv1a(const char *s);
+unsigned int strhash(const char *s);
 unsigned int getbucket(const char *name);
+const char *intern(const char *s);
+void free_strings(void);
 struct file *newfile(char *str, struct file *fphead);
 void freefiles(struct file *fp);
 int is_valid_target(const char *name);
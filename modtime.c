@@ -1,8 +1,23 @@
 /*
  * Get modification time of file or archive member
  */
+#if defined(__linux__)
+// For syscall(2) and statx(2)
+# define _GNU_SOURCE
+#endif
 #include "make.h"
 #include <ar.h>
+#if ENABLE_FEATURE_MAKE_DIRCACHE
+#include <dirent.h>
+#endif
+#if ENABLE_FEATURE_MAKE_PREFETCH
+#include <pthread.h>
+#endif
+#include <sys/mman.h>
+#if ENABLE_FEATURE_MAKE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 /*
  * Read a number from an archive header.
@@ -24,96 +39,250 @@ argetnum(const char *str, int len)
 	return val;
 }
 
+// An index of the members of an archive.  It's rebuilt if the archive
+// changes.
+struct member {
+	char *m_name;			// Name of member, or NULL if slot is unused
+	time_t m_date;			// Timestamp of member
+};
+
+struct archive {
+	struct archive *a_next;	// Next archive in list
+	char *a_name;			// Name of archive
+	struct timespec a_tim;	// Modification time of archive
+	off_t a_len;			// Size of archive
+	ino_t a_ino;			// Inode of archive
+	struct member *a_index;	// Hash table of members
+	size_t a_size;			// Number of slots in table, a power of 2
+	size_t a_count;			// Number of members in table
+};
+
+static struct archive *archives;
+
 /*
- * Search an archive for the given member and return its timestamp or 0.
- * This code assumes System V/GNU archive format.
+ * Find the slot for a member in the index of an archive:  either the
+ * one holding it or the empty one where it would go.
  */
-static time_t
-arsearch(FILE *fd, const char *member)
-{
-	struct ar_hdr hdr;
-	char *s, *t, *names = NULL;
-	size_t len, offset, max_offset = 0;
-	time_t mtime = 0;
-
-	do {
- top:
-		len = fread(&hdr, 1, sizeof(hdr), fd);
-		if (len < sizeof(hdr) ||
-				memcmp(hdr.ar_fmag, ARFMAG, sizeof(hdr.ar_fmag)) != 0) {
-			if (feof(fd))
-				break;
-			error("invalid archive");
+static struct member *
+arslot(struct archive *ap, const char *member)
+{
+	size_t i = strhash(member) & (ap->a_size - 1);
+
+	while (ap->a_index[i].m_name && strcmp(ap->a_index[i].m_name, member))
+		i = (i + 1) & (ap->a_size - 1);
+	return &ap->a_index[i];
+}
+
+/*
+ * Add a member, whose name is 'len' characters long, to the index of an
+ * archive.  If the archive contains more than one member with the same
+ * name the first is used.
+ */
+static void
+aradd(struct archive *ap, const char *name, size_t len, time_t date)
+{
+	struct member *mp, *old;
+	char *member = xstrndup(name, len);
+	size_t i, size;
+
+	if (2 * (ap->a_count + 1) > ap->a_size) {
+		old = ap->a_index;
+		size = ap->a_size;
+		ap->a_size = size ? 2 * size : 64;
+		ap->a_index = xmalloc(ap->a_size * sizeof(struct member));
+		memset(ap->a_index, 0, ap->a_size * sizeof(struct member));
+		for (i = 0; i < size; i++) {
+			if (old[i].m_name)
+				*arslot(ap, old[i].m_name) = old[i];
 		}
+		free(old);
+	}
+
+	mp = arslot(ap, member);
+	if (!mp->m_name) {
+		mp->m_name = member;
+		mp->m_date = date;
+		ap->a_count++;
+	} else {
+		free(member);
+	}
+}
+
+static void
+arclear(struct archive *ap)
+{
+	for (size_t i = 0; i < ap->a_size; i++)
+		free(ap->a_index[i].m_name);
+	free(ap->a_index);
+	ap->a_index = NULL;
+	ap->a_size = ap->a_count = 0;
+}
+
+/*
+ * Read the headers of all the members of an archive, held in memory,
+ * into its index.  Extended names are found in place in the list of
+ * names.  This code assumes System V/GNU archive format.
+ */
+static void
+arindex(const char *buf, size_t size, struct archive *ap)
+{
+	const struct ar_hdr *hdr;
+	const char *p, *s, *t, *end = buf + size, *names = NULL;
+	size_t len, offset, max_offset = 0, room;
+
+	for (p = buf + SARMAG; (size_t)(end - p) >= sizeof(*hdr); p += len) {
+		hdr = (const struct ar_hdr *)p;
+		if (memcmp(hdr->ar_fmag, ARFMAG, sizeof(hdr->ar_fmag)) != 0)
+			error("invalid archive");
+		p += sizeof(*hdr);
 
 		// Get length of this member.  Length in the file is padded
 		// to an even number of bytes.
-		len = argetnum(hdr.ar_size, sizeof(hdr.ar_size));
+		len = argetnum(hdr->ar_size, sizeof(hdr->ar_size));
 		if (len % 2 == 1)
 			len++;
+		if (len > (size_t)(end - p))
+			len = end - p;
 
-		t = hdr.ar_name;
-		if (hdr.ar_name[0] == '/') {
-			if (hdr.ar_name[1] == ' ') {
+		t = hdr->ar_name;
+		room = sizeof(hdr->ar_name);
+		if (hdr->ar_name[0] == '/') {
+			if (hdr->ar_name[1] == ' ') {
 				// Skip symbol table
 				continue;
-			} else if (hdr.ar_name[1] == '/' && names == NULL) {
-				// Save list of extended filenames for later use
-				names = xmalloc(len);
-				if (fread(names, 1, len, fd) != len)
+			} else if (hdr->ar_name[1] == '/' && names == NULL) {
+				// Note list of extended filenames for later use
+				if (argetnum(hdr->ar_size, sizeof(hdr->ar_size)) > len)
 					error("invalid archive");
-				// Replace newline separators with NUL
-				for (s = names; s < names + len; s++) {
-					if (*s == '\n')
-						*s = '\0';
-				}
+				names = p;
 				max_offset = len;
-				goto top;
-			} else if (isdigit(hdr.ar_name[1]) && names) {
+				continue;
+			} else if (isdigit(hdr->ar_name[1]) && names) {
 				// An extended filename, get its offset in the names list
-				offset = argetnum(hdr.ar_name + 1, sizeof(hdr.ar_name) - 1);
+				offset = argetnum(hdr->ar_name + 1, sizeof(hdr->ar_name) - 1);
 				if (offset > max_offset)
 					error("invalid archive");
 				t = names + offset;
+				room = max_offset - offset;
 			} else {
 				error("invalid archive");
 			}
 		}
 
-		s = strchr(t, '/');
-		if (s == NULL)
+		// Names end with a slash, which must come before the newline
+		// separating extended names.
+		for (s = t; s < t + room && *s != '/' && *s != '\n'; s++)
+			;
+		if (s == t + room || *s != '/')
 			error("invalid archive");
-		*s = '\0';
 
-		if (strcmp(t, member) == 0) {
-			mtime = argetnum(hdr.ar_date, sizeof(hdr.ar_date));
+		aradd(ap, t, s - t, argetnum(hdr->ar_date, sizeof(hdr->ar_date)));
+	}
+}
+
+/*
+ * Index the members of an archive.  The archive is mapped into memory
+ * or, if that isn't possible, read.
+ */
+static void
+arread(int fd, size_t size, struct archive *ap)
+{
+	char *buf;
+	ssize_t n;
+	size_t len;
+
+	buf = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	if (buf != MAP_FAILED) {
+		if (memcmp(buf, ARMAG, SARMAG) != 0)
+			error("%s: not an archive", ap->a_name);
+		arindex(buf, size, ap);
+		munmap(buf, size);
+		return;
+	}
+
+	buf = xmalloc(size + 1);
+	for (len = 0; len < size; len += n) {
+		if ((n = read(fd, buf + len, size - len)) <= 0) {
+			if (n < 0 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
 			break;
 		}
-	} while (fseek(fd, len, SEEK_CUR) == 0);
-	free(names);
-	return mtime;
+	}
+	if (len < SARMAG || memcmp(buf, ARMAG, SARMAG) != 0)
+		error("%s: not an archive", ap->a_name);
+	arindex(buf, len, ap);
+	free(buf);
 }
 
+/*
+ * Return the timestamp of a member of an archive, or 0 if either
+ * doesn't exist.  The archive is only read if it has changed since
+ * it was last indexed.
+ */
 static time_t
 artime(const char *archive, const char *member)
 {
-	FILE *fd;
-	char magic[SARMAG];
-	size_t len;
-	time_t mtime;
+	struct archive *ap;
+	struct stat info;
+	struct member *mp;
+	int fd;
+
+	for (ap = archives; ap; ap = ap->a_next) {
+		if (strcmp(archive, ap->a_name) == 0)
+			break;
+	}
+
+	if (stat(archive, &info) < 0)
+		return 0;
+
+	if (!ap || ap->a_tim.tv_sec != info.st_mtim.tv_sec ||
+			ap->a_tim.tv_nsec != info.st_mtim.tv_nsec ||
+			ap->a_len != info.st_size || ap->a_ino != info.st_ino) {
+		fd = open(archive, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return 0;
+		if (fstat(fd, &info) < 0)
+			error("can't open %s: %s", archive, strerror(errno));
+		if (info.st_size < SARMAG)
+			error("%s: not an archive", archive);
+
+		if (!ap) {
+			ap = xmalloc(sizeof(struct archive));
+			memset(ap, 0, sizeof(struct archive));
+			ap->a_next = archives;
+			archives = ap;
+			ap->a_name = xstrdup(archive);
+		}
+		arclear(ap);
+		arread(fd, info.st_size, ap);
+		close(fd);
+		ap->a_tim = info.st_mtim;
+		ap->a_len = info.st_size;
+		ap->a_ino = info.st_ino;
+	}
 
-	fd = fopen(archive, "r");
-	if (fd == NULL)
+	if (!ap->a_size)
 		return 0;
+	mp = arslot(ap, member);
+	return mp->m_name ? mp->m_date : 0;
+}
 
-	len = fread(magic, 1, sizeof(magic), fd);
-	if (len < sizeof(magic) || memcmp(magic, ARMAG, SARMAG) != 0)
-		error("%s: not an archive", archive);
+#if ENABLE_FEATURE_CLEAN_UP
+void
+free_archives(void)
+{
+	struct archive *ap, *next;
 
-	mtime = arsearch(fd, member);
-	fclose(fd);
-	return mtime;
+	for (ap = archives; ap; ap = next) {
+		next = ap->a_next;
+		arclear(ap);
+		free(ap->a_name);
+		free(ap);
+	}
 }
+#endif
 
 /*
  * If the name is of the form 'libname(member.o)' split it into its
@@ -170,3 +339,452 @@ modtime(struct name *np)
 	}
 	free(name);
 }
+
+#if ENABLE_FEATURE_MAKE_DIRCACHE
+// Cached directory listings.  A listing is trusted until a command has
+// run or a file has been touched, as these may have changed the contents
+// of the directory.  After that it's checked against the modification
+// time of the directory.
+struct dir {
+	struct dir *d_next;		// Next directory in this bucket
+	char *d_name;			// Name of directory
+	char **d_ents;			// Sorted names of entries, or NULL
+	char *d_buf;			// Storage for names of entries
+	size_t d_count;			// Number of entries
+	struct timespec d_tim;	// Modification time of directory
+	unsigned long d_gen;	// Generation when listing was checked
+	bool d_racy;			// Directory changed as it was read
+};
+
+static struct dir *dirhead[HTABSIZE];
+static unsigned long generation = 1;
+
+static int
+compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Read the entries of a directory into its listing.  If it can't be
+ * read the listing is left empty.
+ */
+static void
+read_dir(struct dir *dp)
+{
+	struct timespec now;
+	struct stat info;
+	struct dirent *ent;
+	DIR *dirp;
+	size_t len, used = 0, max = 0, *offset = NULL, nmax = 0, i;
+
+	free(dp->d_ents);
+	free(dp->d_buf);
+	dp->d_ents = NULL;
+	dp->d_buf = NULL;
+	dp->d_count = 0;
+	dp->d_gen = generation;
+
+	// If the directory doesn't exist neither do any files in it
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (stat(dp->d_name, &info) < 0) {
+		if (errno == ENOENT || errno == ENOTDIR) {
+			dp->d_ents = xmalloc(sizeof(char *));
+			dp->d_tim.tv_sec = dp->d_tim.tv_nsec = 0;
+			dp->d_racy = FALSE;
+		}
+		return;
+	}
+	if (!(dirp = opendir(dp->d_name)))
+		return;
+
+	// Names are packed into one buffer which may move as it grows, so
+	// their offsets are kept until it's complete.
+	while ((ent = readdir(dirp))) {
+		len = strlen(ent->d_name) + 1;
+		if (used + len > max) {
+			max = MAX(2 * max, used + len + 1024);
+			dp->d_buf = xrealloc(dp->d_buf, max);
+		}
+		if (dp->d_count == nmax) {
+			nmax = nmax ? 2 * nmax : 64;
+			offset = xrealloc(offset, nmax * sizeof(size_t));
+		}
+		memcpy(dp->d_buf + used, ent->d_name, len);
+		offset[dp->d_count++] = used;
+		used += len;
+	}
+	closedir(dirp);
+
+	dp->d_ents = xmalloc((dp->d_count + 1) * sizeof(char *));
+	for (i = 0; i < dp->d_count; i++)
+		dp->d_ents[i] = dp->d_buf + offset[i];
+	free(offset);
+	qsort(dp->d_ents, dp->d_count, sizeof(char *), compare_names);
+
+	// A change made in the same second as the directory was read may
+	// not alter its modification time on some filesystems.
+	dp->d_tim = info.st_mtim;
+	dp->d_racy = info.st_mtim.tv_sec >= now.tv_sec - 1;
+}
+
+/*
+ * Return FALSE if the listing of its directory shows a file doesn't
+ * exist.  Otherwise, including when the directory can't be read, its
+ * modification time has to be fetched to find out.
+ */
+int
+may_exist(const char *name)
+{
+	struct dir *dp;
+	struct stat info;
+	const char *base = strrchr(name, '/');
+	char *dir;
+	unsigned int bucket;
+
+	if (base) {
+		dir = base == name ? xstrdup("/") : xstrndup(name, base - name);
+		base++;
+	} else {
+		dir = xstrdup(".");
+		base = name;
+	}
+	if (!*base) {
+		free(dir);
+		return TRUE;
+	}
+
+	bucket = getbucket(dir);
+	for (dp = dirhead[bucket]; dp; dp = dp->d_next) {
+		if (strcmp(dir, dp->d_name) == 0)
+			break;
+	}
+	if (!dp) {
+		dp = xmalloc(sizeof(struct dir));
+		memset(dp, 0, sizeof(struct dir));
+		dp->d_next = dirhead[bucket];
+		dirhead[bucket] = dp;
+		dp->d_name = dir;
+		read_dir(dp);
+	} else {
+		free(dir);
+		if (dp->d_gen != generation) {
+			if (!dp->d_racy && stat(dp->d_name, &info) == 0 &&
+					info.st_mtim.tv_sec == dp->d_tim.tv_sec &&
+					info.st_mtim.tv_nsec == dp->d_tim.tv_nsec)
+				dp->d_gen = generation;
+			else
+				read_dir(dp);
+		}
+	}
+
+	return !dp->d_ents || bsearch(&base, dp->d_ents, dp->d_count,
+									sizeof(char *), compare_names);
+}
+
+#if ENABLE_FEATURE_CLEAN_UP
+void
+free_dirs(void)
+{
+	struct dir *dp, *next;
+
+	for (int i = 0; i < HTABSIZE; i++) {
+		for (dp = dirhead[i]; dp; dp = next) {
+			next = dp->d_next;
+			free(dp->d_name);
+			free(dp->d_ents);
+			free(dp->d_buf);
+			free(dp);
+		}
+	}
+}
+#endif
+#endif
+
+#if ENABLE_FEATURE_MAKE_PREFETCH
+// Names whose modification times are being prefetched.  Worker threads
+// take batches of names from the list:  only the index of the next
+// batch is shared.
+#define PREFETCH_THREADS 8
+#define PREFETCH_BATCH 32
+static struct name **pf_names;
+static size_t pf_count, pf_next;
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool prefetched;		// Some names have prefetched times
+
+static void *
+prefetch_worker(void *arg)
+{
+	struct stat info;
+	size_t i, end;
+
+	for (;;) {
+		pthread_mutex_lock(&pf_lock);
+		i = pf_next;
+		end = pf_next = MIN(i + PREFETCH_BATCH, pf_count);
+		pthread_mutex_unlock(&pf_lock);
+		if (i == end)
+			break;
+		// Files which don't exist or can't be accessed are left for
+		// modtime() to deal with.
+		for (; i < end; i++) {
+			if (stat(pf_names[i]->n_name, &info) == 0)
+				pf_names[i]->n_tim = info.st_mtim;
+		}
+	}
+	return arg;
+}
+
+#if ENABLE_FEATURE_MAKE_IO_URING
+#define URING_ENTRIES 256
+
+/*
+ * Map part of an io_uring into memory.
+ */
+static void *
+uring_map(int fd, size_t len, off_t offset)
+{
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				fd, offset);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * Prefetch modification times by submitting statx(2) requests to an
+ * io_uring, keeping up to URING_ENTRIES of them in flight.  Return
+ * FALSE if io_uring, or its support for statx(2), isn't available.
+ */
+static bool
+prefetch_uring(void)
+{
+	struct io_uring_params p;
+	struct io_uring_sqe *sqes = NULL, *sqe;
+	struct io_uring_cqe *cqe;
+	struct statx *stx;
+	char *sq = NULL, *cq = NULL;
+	size_t sq_len = 0, cq_len = 0, sqe_len = 0;
+	unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+	unsigned head, tail, nfree, pending = 0;
+	size_t *owner, *slots, next = 0, inflight = 0;
+	bool ok = FALSE, broken = FALSE;
+	int fd;
+	long n;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0)
+		return FALSE;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (!(sq = uring_map(fd, sq_len, IORING_OFF_SQ_RING)) ||
+			!(cq = uring_map(fd, cq_len, IORING_OFF_CQ_RING)) ||
+			!(sqes = uring_map(fd, sqe_len, IORING_OFF_SQES)))
+		goto done;
+
+	sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq_head = (unsigned *)(cq + p.cq_off.head);
+	cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+
+	// Each request in flight has a slot for its result.  The completion
+	// queue is at least as big as the submission queue so it can't
+	// overflow.
+	stx = xmalloc(p.sq_entries * sizeof(struct statx));
+	owner = xmalloc(p.sq_entries * sizeof(size_t));
+	slots = xmalloc(p.sq_entries * sizeof(size_t));
+	for (nfree = 0; nfree < p.sq_entries; nfree++)
+		slots[nfree] = nfree;
+
+	while ((next < pf_count && !broken) || inflight) {
+		tail = *sq_tail;
+		for (; next < pf_count && nfree && !broken; next++) {
+			size_t slot = slots[--nfree];
+
+			owner[slot] = next;
+			sqe = &sqes[tail & *sq_mask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t)pf_names[next]->n_name;
+			sqe->len = STATX_MTIME;
+			sqe->addr2 = (uintptr_t)&stx[slot];
+			sqe->user_data = slot;
+			sq_array[tail & *sq_mask] = tail & *sq_mask;
+			tail++;
+			pending++;
+			inflight++;
+		}
+		__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+		n = syscall(SYS_io_uring_enter, fd, pending, 1,
+						IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			// Requests already submitted may still write to their
+			// slots, so these are deliberately not freed.
+			goto done;
+		}
+		pending -= n;
+
+		head = *cq_head;
+		tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = (struct io_uring_cqe *)(cq + p.cq_off.cqes) +
+					(head & *cq_mask);
+			if (cqe->res == 0) {
+				struct name *np = pf_names[owner[cqe->user_data]];
+				struct statx *sp = &stx[cqe->user_data];
+
+				np->n_tim.tv_sec = sp->stx_mtime.tv_sec;
+				np->n_tim.tv_nsec = sp->stx_mtime.tv_nsec;
+			} else if (cqe->res == -EINVAL) {
+				// Kernel doesn't support IORING_OP_STATX
+				broken = TRUE;
+			}
+			slots[nfree++] = cqe->user_data;
+			inflight--;
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	}
+	ok = !broken;
+	free(slots);
+	free(owner);
+	free(stx);
+ done:
+	if (sqes)
+		munmap(sqes, sqe_len);
+	if (cq)
+		munmap(cq, cq_len);
+	if (sq)
+		munmap(sq, sq_len);
+	close(fd);
+	return ok;
+}
+#else
+# define prefetch_uring() FALSE
+#endif
+
+/*
+ * Add a name to the list to be prefetched, unless it's already there.
+ */
+static void
+prefetch_add(struct name *np, size_t *max)
+{
+	if (!np || (np->n_flag & N_MARK))
+		return;
+	np->n_flag |= N_MARK;
+	if (pf_count == *max) {
+		*max = *max ? 2 * *max : 256;
+		pf_names = xrealloc(pf_names, *max * sizeof(struct name *));
+	}
+	pf_names[pf_count++] = np;
+}
+
+/*
+ * Get the modification times of the targets and all the prerequisites
+ * reachable from them before they're needed, using an io_uring or
+ * several threads so the latency of slow filesystems overlaps.  Macro
+ * assignments among the targets are ignored.  If there are none the
+ * first target in the makefile is used.  Prerequisites found by
+ * inference rules, archive members and phony targets are left to be
+ * dealt with normally.
+ */
+void
+prefetch_modtimes(char **targets)
+{
+	pthread_t threads[PREFETCH_THREADS];
+	struct depend *dp;
+	struct rule *rp;
+	size_t i, max = 0, nthreads = 0;
+	bool found = FALSE;
+
+	for (; *targets; targets++) {
+		if (!strchr(*targets, '=')) {
+			prefetch_add(findname(*targets), &max);
+			found = TRUE;
+		}
+	}
+	if (!found)
+		prefetch_add(firstname, &max);
+
+	// The list grows as it's scanned:  it ends up holding everything
+	// reachable from the targets.
+	for (i = 0; i < pf_count; i++) {
+		for (rp = pf_names[i]->n_rule; rp; rp = rp->r_next) {
+			for (dp = rp->r_dep; dp; dp = dp->d_next)
+				prefetch_add(dp->d_name, &max);
+		}
+	}
+
+	// Clear the marks and drop names which don't need a stat(2).
+	for (max = i = 0; i < pf_count; i++) {
+		pf_names[i]->n_flag &= ~N_MARK;
+		if (!(pf_names[i]->n_flag & (N_PHONY | N_WAIT | N_SPECIAL)) &&
+				!pf_names[i]->n_tim.tv_sec &&
+				!strchr(pf_names[i]->n_name, '('))
+			pf_names[max++] = pf_names[i];
+	}
+	pf_count = max;
+
+	// It's not worth setting up an io_uring or starting threads for
+	// a few names
+	if (pf_count >= 4 * PREFETCH_BATCH && !prefetch_uring()) {
+		for (; nthreads < PREFETCH_THREADS &&
+				nthreads * 4 * PREFETCH_BATCH < pf_count; nthreads++) {
+			if (pthread_create(&threads[nthreads], NULL,
+					prefetch_worker, NULL) != 0)
+				break;
+		}
+		prefetch_worker(NULL);
+		while (nthreads > 0)
+			pthread_join(threads[--nthreads], NULL);
+	}
+
+	for (i = 0; i < pf_count; i++) {
+		if (pf_names[i]->n_tim.tv_sec)
+			pf_names[i]->n_prefetch = prefetched = TRUE;
+	}
+	free(pf_names);
+	pf_names = NULL;
+	pf_count = pf_next = 0;
+}
+#endif
+
+#if ENABLE_FEATURE_MAKE_DIRCACHE || ENABLE_FEATURE_MAKE_PREFETCH
+/*
+ * Note that files may have been created, removed or rewritten so cached
+ * listings have to be checked before they're used again.  Prefetched
+ * modification times which haven't been used yet are dropped:  they're
+ * fetched again when needed.
+ */
+void
+files_changed(void)
+{
+# if ENABLE_FEATURE_MAKE_DIRCACHE
+	generation++;
+# endif
+# if ENABLE_FEATURE_MAKE_PREFETCH
+	if (prefetched) {
+		struct name *np;
+
+		prefetched = FALSE;
+		for (unsigned int i = 0; i < namesize; i++) {
+			for (np = namehead[i]; np; np = np->n_next) {
+				if (np->n_prefetch) {
+					np->n_prefetch = FALSE;
+					np->n_tim.tv_sec = 0;
+					np->n_tim.tv_nsec = 0;
+				}
+			}
+		}
+	}
+# endif
+}
+#endif
@@ -14,6 +14,26 @@ suffix(const char *name)
 	return p ? p : (char *)name + strlen(name);
 }
 
+/*
+ * Concatenate two strings in a buffer which is reused by the next call.
+ */
+static const char *
+concat(const char *s, const char *t)
+{
+	static char *buf;
+	static size_t size;
+	size_t len1 = strlen(s);
+	size_t len2 = strlen(t) + 1;
+
+	if (len1 + len2 > size) {
+		size = len1 + len2 + 64;
+		buf = xrealloc(buf, size);
+	}
+	memcpy(buf, s, len1);
+	memcpy(buf + len1, t, len2);
+	return buf;
+}
+
 /*
  * Find a name structure whose name is formed by concatenating two
  * strings.  If 'create' is TRUE the name is created if necessary.
@@ -21,13 +41,9 @@ suffix(const char *name)
 static struct name *
 namecat(const char *s, const char *t, int create)
 {
-	char *p;
-	struct name *np;
+	const char *p = concat(s, t);
 
-	p = xconcat3(s, t, "");
-	np = create ? newname(p) : findname(p);
-	free(p);
-	return np;
+	return create ? newname(p) : findname(p);
 }
 
 /*
@@ -56,6 +72,7 @@ dyndep0(char *base, const char *tsuff, struct rule *infrule)
 			sp = namecat(psuff, tsuff, FALSE);
 			if (sp && sp->n_rule) {
 				struct name *ip;
+				const char *ipname;
 				int got_ip;
 
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
@@ -63,12 +80,17 @@ dyndep0(char *base, const char *tsuff, struct rule *infrule)
 				if ((sp->n_flag & N_MARK))
 					continue;
 #endif
-				// Generate a name for an implicit prerequisite
-				ip = namecat(base, psuff, TRUE);
-				if ((ip->n_flag & N_DOING))
+				// Generate a name for an implicit prerequisite.  Unless
+				// it's needed for a chain of rules there's no point in
+				// creating it if it's known not to exist.
+				ipname = concat(base, psuff);
+				ip = findname(ipname);
+				if (!ip && (chain || may_exist(ipname)))
+					ip = newname(ipname);
+				if (!ip || (ip->n_flag & N_DOING))
 					continue;
 
-				if (!ip->n_tim.tv_sec)
+				if (!ip->n_tim.tv_sec && may_exist(ip->n_name))
 					modtime(ip);
 
 				if (!chain) {
@@ -85,7 +107,7 @@ dyndep0(char *base, const char *tsuff, struct rule *infrule)
 				if (got_ip) {
 					// Prerequisite exists or we know how to make it
 					if (infrule) {
-						infrule->r_dep = newdep(ip, NULL);
+						newdep(ip, &infrule->r_dep);
 						infrule->r_cmd = sp->n_rule->r_cmd;
 					}
 					return ip;
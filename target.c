@@ -3,30 +3,65 @@
  */
 #include "make.h"
 
+// Rules, prerequisites and commands are allocated from the arena.
+// Those which are freed are kept for reuse.
+static struct rule *free_rules;
+static struct depend *free_deps;
+static struct cmd *free_cmds;
+
+struct rule *
+alloc_rule(void)
+{
+	struct rule *rp = free_rules;
+
+	if (rp)
+		free_rules = rp->r_next;
+	else
+		rp = arena_alloc(sizeof(struct rule));
+	return rp;
+}
+
+struct depend *
+alloc_dep(void)
+{
+	struct depend *dp = free_deps;
+
+	if (dp)
+		free_deps = dp->d_next;
+	else
+		dp = arena_alloc(sizeof(struct depend));
+	return dp;
+}
+
+struct cmd *
+alloc_cmd(void)
+{
+	struct cmd *cp = free_cmds;
+
+	if (cp)
+		free_cmds = cp->c_next;
+	else
+		cp = arena_alloc(sizeof(struct cmd));
+	return cp;
+}
+
 /*
- * Add a prerequisite to the end of the supplied list.
- * Return the new head pointer for that list.
+ * Add a prerequisite to the end of a list.  'dpp' points to the NULL
+ * pointer which ends the list.  Return a pointer to the one which now
+ * ends it, so appending is O(1).
  */
-struct depend *
-newdep(struct name *np, struct depend *dphead)
+struct depend **
+newdep(struct name *np, struct depend **dpp)
 {
 	struct depend *dpnew;
-	struct depend *dp;
 
-	dpnew = xmalloc(sizeof(struct depend));
+	dpnew = alloc_dep();
 	dpnew->d_next = NULL;
 	dpnew->d_name = np;
 	dpnew->d_refcnt = 0;
+	*dpp = dpnew;
 
-	if (dphead == NULL)
-		return dpnew;
-
-	for (dp = dphead; dp->d_next; dp = dp->d_next)
-		;
-
-	dp->d_next = dpnew;
-
-	return dphead;
+	return &dpnew->d_next;
 }
 
 void
@@ -37,40 +72,34 @@ freedeps(struct depend *dp)
 	if (dp && --dp->d_refcnt <= 0) {
 		for (; dp; dp = nextdp) {
 			nextdp = dp->d_next;
-			free(dp);
+			dp->d_next = free_deps;
+			free_deps = dp;
 		}
 	}
 }
 
 /*
- * Add a command to the end of the supplied list of commands.
- * Return the new head pointer for that list.
+ * Add a command to the end of a list of commands.  'cpp' points to the
+ * NULL pointer which ends the list.  Return a pointer to the one which
+ * now ends it.
  */
-struct cmd *
-newcmd(char *str, struct cmd *cphead)
+struct cmd **
+newcmd(char *str, struct cmd **cpp)
 {
 	struct cmd *cpnew;
-	struct cmd *cp;
 
 	while (isspace(*str))
 		str++;
 
-	cpnew = xmalloc(sizeof(struct cmd));
+	cpnew = alloc_cmd();
 	cpnew->c_next = NULL;
-	cpnew->c_cmd = xstrdup(str);
+	cpnew->c_cmd = intern(str);
 	cpnew->c_refcnt = 0;
-	cpnew->c_makefile = xstrdup(makefile);
+	cpnew->c_makefile = makefile ? intern(makefile) : NULL;
 	cpnew->c_dispno = dispno;
+	*cpp = cpnew;
 
-	if (cphead == NULL)
-		return cpnew;
-
-	for (cp = cphead; cp->c_next; cp = cp->c_next)
-		;
-
-	cp->c_next = cpnew;
-
-	return cphead;
+	return &cpnew->c_next;
 }
 
 void
@@ -81,28 +110,85 @@ freecmds(struct cmd *cp)
 	if (cp && --cp->c_refcnt <= 0) {
 		for (; cp; cp = nextcp) {
 			nextcp = cp->c_next;
-			free(cp->c_cmd);
-			free((void *)cp->c_makefile);
-			free(cp);
+			cp->c_next = free_cmds;
+			free_cmds = cp;
 		}
 	}
 }
 
-struct name *namehead[HTABSIZE];
+struct name **namehead;
+unsigned int namesize;
+unsigned int namecount;
 struct name *firstname;
 
-struct name *
-findname(const char *name)
+static struct name *
+lookup_name(const char *name, unsigned int hash)
 {
 	struct name *np;
 
-	for (np = namehead[getbucket(name)]; np; np = np->n_next) {
-		if (strcmp(name, np->n_name) == 0)
+	if (namesize == 0)
+		return NULL;
+
+	for (np = namehead[hash & (namesize - 1)]; np; np = np->n_next) {
+		if (np->n_hash == hash && strcmp(name, np->n_name) == 0)
 			return np;
 	}
 	return NULL;
 }
 
+struct name *
+findname(const char *name)
+{
+	return lookup_name(name, strhash(name));
+}
+
+/*
+ * Change the number of buckets in the table of names to 'size', a power
+ * of 2.  Names which end up in the same bucket keep their order.
+ */
+void
+resize_names(unsigned int size)
+{
+	struct name **head, ***tail, *np, *next;
+	unsigned int i;
+
+	head = xmalloc(size * sizeof(struct name *));
+	tail = xmalloc(size * sizeof(struct name **));
+	for (i = 0; i < size; i++) {
+		head[i] = NULL;
+		tail[i] = &head[i];
+	}
+	for (i = 0; i < namesize; i++) {
+		for (np = namehead[i]; np; np = next) {
+			next = np->n_next;
+			np->n_next = NULL;
+			*tail[np->n_hash & (size - 1)] = np;
+			tail[np->n_hash & (size - 1)] = &np->n_next;
+		}
+	}
+	free(tail);
+	free(namehead);
+	namehead = head;
+	namesize = size;
+}
+
+/*
+ * Add a new name to the head of its bucket, growing the table first if
+ * it's full.
+ */
+static void
+addname(struct name *np)
+{
+	unsigned int bucket;
+
+	if (namecount >= namesize)
+		resize_names(namesize ? 2 * namesize : 256);
+	bucket = np->n_hash & (namesize - 1);
+	np->n_next = namehead[bucket];
+	namehead[bucket] = np;
+	namecount++;
+}
+
 static int
 check_name(const char *name)
 {
@@ -178,11 +264,10 @@ potentially_valid_target(const char *name)
 struct name *
 newname(const char *name)
 {
-	struct name *np = findname(name);
+	unsigned int hash = strhash(name);
+	struct name *np = lookup_name(name, hash);
 
 	if (np == NULL) {
-		unsigned int bucket;
-
 		if (!is_valid_target(name))
 #if ENABLE_FEATURE_MAKE_EXTENSIONS
 			error("invalid target name '%s'%s", name,
@@ -192,14 +277,18 @@ newname(const char *name)
 			error("invalid target name '%s'", name);
 #endif
 
-		bucket = getbucket(name);
-		np = xmalloc(sizeof(struct name));
-		np->n_next = namehead[bucket];
-		namehead[bucket] = np;
-		np->n_name = xstrdup(name);
+		np = arena_alloc(sizeof(struct name));
+		np->n_name = arena_strdup(name);
+		np->n_hash = hash;
 		np->n_rule = NULL;
+		np->n_last = NULL;
 		np->n_tim = (struct timespec){0, 0};
+		np->n_job = NULL;
 		np->n_flag = 0;
+#if ENABLE_FEATURE_MAKE_PREFETCH
+		np->n_prefetch = FALSE;
+#endif
+		addname(np);
 	}
 	return np;
 }
@@ -222,20 +311,14 @@ getcmd(struct name *np)
 }
 
 #if ENABLE_FEATURE_CLEAN_UP
+/*
+ * Free the table of names.  The names themselves, and their rules,
+ * are freed with the arena.
+ */
 void
 freenames(void)
 {
-	int i;
-	struct name *np, *nextnp;
-
-	for (i = 0; i < HTABSIZE; i++) {
-		for (np = namehead[i]; np; np = nextnp) {
-			nextnp = np->n_next;
-			free(np->n_name);
-			freerules(np->n_rule);
-			free(np);
-		}
-	}
+	free(namehead);
 }
 #endif
 
@@ -248,7 +331,8 @@ freerules(struct rule *rp)
 		nextrp = rp->r_next;
 		freedeps(rp->r_dep);
 		freecmds(rp->r_cmd);
-		free(rp);
+		rp->r_next = free_rules;
+		free_rules = rp;
 	}
 }
 
@@ -394,11 +478,8 @@ addrule(struct name *np, struct depend *dp, struct cmd *cp, int flag)
 		}
 	}
 
-	rpp = &np->n_rule;
-	while (*rpp)
-		rpp = &(*rpp)->r_next;
-
-	*rpp = rp = xmalloc(sizeof(struct rule));
+	rpp = np->n_rule ? &np->n_last->r_next : &np->n_rule;
+	*rpp = rp = np->n_last = alloc_rule();
 	rp->r_next = NULL;
 	rp->r_dep = inc_ref(dp);
 	rp->r_cmd = inc_ref(cp);
@@ -102,6 +102,78 @@ xrealloc(void *ptr, size_t len)
 	return ret;
 }
 
+// Names, macros, rules, prerequisites, commands and interned strings
+// last until make exits.  They're allocated from an arena, a list of
+// large chunks which are freed together.
+#define CHUNK_SIZE 65536
+
+union align {
+	void *a_ptr;
+	long long a_ll;
+	long double a_ld;
+};
+
+struct chunk {
+	struct chunk *ch_next;
+	union align ch_data[];
+};
+
+static struct chunk *chunks;
+static char *arena_ptr, *arena_end;
+
+void *
+arena_alloc(size_t len)
+{
+	struct chunk *ch;
+	void *ret;
+
+	len = (len + sizeof(union align) - 1) / sizeof(union align) *
+			sizeof(union align);
+	if (len > (size_t)(arena_end - arena_ptr)) {
+		if (len > CHUNK_SIZE / 4) {
+			// Large objects get a chunk of their own
+			ch = xmalloc(sizeof(struct chunk) + len);
+			if (chunks) {
+				ch->ch_next = chunks->ch_next;
+				chunks->ch_next = ch;
+			} else {
+				ch->ch_next = NULL;
+				chunks = ch;
+			}
+			return ch->ch_data;
+		}
+		ch = xmalloc(sizeof(struct chunk) + CHUNK_SIZE);
+		ch->ch_next = chunks;
+		chunks = ch;
+		arena_ptr = (char *)ch->ch_data;
+		arena_end = arena_ptr + CHUNK_SIZE;
+	}
+	ret = arena_ptr;
+	arena_ptr += len;
+	return ret;
+}
+
+char *
+arena_strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	return memcpy(arena_alloc(len), s, len);
+}
+
+#if ENABLE_FEATURE_CLEAN_UP
+void
+free_arena(void)
+{
+	struct chunk *ch, *next;
+
+	for (ch = chunks; ch; ch = next) {
+		next = ch->ch_next;
+		free(ch);
+	}
+}
+#endif
+
 char *
 xconcat3(const char *s1, const char *s2, const char *s3)
 {
@@ -156,17 +228,134 @@ xappendword(const char *str, const char *word)
 	return newstr;
 }
 
+/*
+ * Append a word to a string of words.  The buffer grows geometrically
+ * so building a list of n words takes time proportional to its length,
+ * unlike repeated calls to xappendword().
+ */
+void
+addword(struct words *wp, const char *word)
+{
+	size_t len = strlen(word);
+	size_t need = wp->w_len + len + 2;
+	bool first = wp->w_buf == NULL;
+
+	if (need > wp->w_size) {
+		wp->w_size = need > 2 * wp->w_size ? need + 64 : 2 * wp->w_size;
+		wp->w_buf = xrealloc(wp->w_buf, wp->w_size);
+	}
+	if (!first)
+		wp->w_buf[wp->w_len++] = ' ';
+	memcpy(wp->w_buf + wp->w_len, word, len + 1);
+	wp->w_len += len;
+}
+
+/*
+ * Calculate the 32-bit FNV-1a hash of a string.
+ */
+uint32_t
+fnv1a(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *s; s++) {
+		h ^= (unsigned char)*s;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Hash a string.  This is the FNV-1a hash followed by a final mix, as
+ * tables whose size is a power of 2 only use the low bits.
+ */
+unsigned int
+strhash(const char *s)
+{
+	uint32_t h = fnv1a(s);
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
 unsigned int
 getbucket(const char *name)
 {
-	unsigned int hashval = 0;
-	const unsigned char *p = (unsigned char *)name;
+	return strhash(name) % HTABSIZE;
+}
+
+// Table of interned strings.  The number of buckets is a power of 2
+// and grows with the number of strings.
+struct string {
+	struct string *s_next;	// Next string in this bucket
+	unsigned int s_hash;	// Hash of string
+	char s_str[];			// The string itself
+};
 
-	while (*p)
-		hashval ^= (hashval << 5) + (hashval >> 2) + *p++;
-	return hashval % HTABSIZE;
+static struct string **stringhead;
+static unsigned int stringsize;
+static unsigned int stringcount;
+
+/*
+ * Return a copy of a string which is shared by all identical strings.
+ * It must not be altered or freed.
+ */
+const char *
+intern(const char *s)
+{
+	unsigned int hash = strhash(s);
+	unsigned int i, bucket;
+	struct string *sp, *next, **head;
+	size_t len;
+
+	if (stringsize) {
+		for (sp = stringhead[hash & (stringsize - 1)]; sp; sp = sp->s_next) {
+			if (sp->s_hash == hash && strcmp(s, sp->s_str) == 0)
+				return sp->s_str;
+		}
+	}
+
+	if (stringcount >= stringsize) {
+		unsigned int size = stringsize ? 2 * stringsize : 256;
+
+		head = xmalloc(size * sizeof(struct string *));
+		memset(head, 0, size * sizeof(struct string *));
+		for (i = 0; i < stringsize; i++) {
+			for (sp = stringhead[i]; sp; sp = next) {
+				next = sp->s_next;
+				bucket = sp->s_hash & (size - 1);
+				sp->s_next = head[bucket];
+				head[bucket] = sp;
+			}
+		}
+		free(stringhead);
+		stringhead = head;
+		stringsize = size;
+	}
+
+	len = strlen(s) + 1;
+	sp = arena_alloc(sizeof(struct string) + len);
+	sp->s_hash = hash;
+	memcpy(sp->s_str, s, len);
+	bucket = hash & (stringsize - 1);
+	sp->s_next = stringhead[bucket];
+	stringhead[bucket] = sp;
+	stringcount++;
+	return sp->s_str;
 }
 
+#if ENABLE_FEATURE_CLEAN_UP
+void
+free_strings(void)
+{
+	free(stringhead);
+}
+#endif
+
 /*
  * Add a file to the end of the supplied list of files.
  * Return the new head pointer for that list.